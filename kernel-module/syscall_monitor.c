@@ -6,6 +6,34 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/sched.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/irq_work.h>
+#include <linux/hrtimer.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/tracepoint.h>
+#include <linux/sched/signal.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/jump_label.h>
+#include <linux/string.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/linkage.h>
+#include <linux/objtool.h>
+#include <linux/cgroup.h>
+#include <linux/audit.h>
+#include <asm/unistd.h>
+#include <asm/syscall.h>
+#include <asm/local.h>
 
 #define DEVICE_NAME "syscall_monitor"
 #define CLASS_NAME "syscall_mon"
@@ -14,116 +42,2723 @@
 #define MODE_OFF 0
 #define MODE_LOG 1
 #define MODE_BLOCK 2
+#define MODE_FSM 3
+#define MODE_LATENCY 4
+#define MODE_THROTTLE 5
+#define SM_NR_MODES 6
 
 // Syscall types
 #define SYSCALL_OPEN 0
 #define SYSCALL_READ 1
 #define SYSCALL_WRITE 2
+#define SYSCALL_CLOSE 3
+#define SYSCALL_MMAP 4
+#define SYSCALL_CONNECT 5
+#define SYSCALL_ACCEPT 6
+#define SYSCALL_EXECVE 7
+#define SM_NR_SYSCALLS 8
+#define SM_SYSCALL_MASK_ALL ((1U << SM_NR_SYSCALLS) - 1)
 
+// Event outcomes
+#define OUTCOME_LOGGED 0
+#define OUTCOME_BLOCKED 1
+#define OUTCOME_FSM_TRANSITION 2
+#define OUTCOME_FSM_ACCEPT 3
+#define OUTCOME_THROTTLED 4
 
-static int current_mode = MODE_OFF;
-static int target_syscall = SYSCALL_OPEN;
-static pid_t target_pid = -1;  
+// Per-CPU event rings: one header page followed by the data pages.
+// mmap offset cpu * SM_RING_MMAP_SIZE selects the ring of that CPU.
+#define SM_RING_PAGES 64
+#define SM_RING_DATA_SIZE (SM_RING_PAGES * PAGE_SIZE)
+#define SM_RING_MMAP_SIZE ((SM_RING_PAGES + 1) * PAGE_SIZE)
+
+// Binary event record: this header, then for captured calls an argument
+// section. Sizes are multiples of the header size, so the filler record
+// that skips to the start of the ring always fits and nothing wraps.
+#define SM_EVENT_ARGS 0x1           // struct sm_event_args follows
+#define SM_EVENT_PAD 0x2            // filler up to the ring end, skip it
+#define SM_EVENT_SPAN 0x4           // coalesced calls, struct sm_event_span follows
+
+struct sm_event {
+    __u64 timestamp_ns;
+    __u32 pid;
+    __u32 tgid;
+    __u16 syscall_id;
+    __u8 mode;
+    __u8 outcome;
+    __u16 state_from;               // FSM events only
+    __u16 state_to;
+    __u32 weight;                   // calls this record stands for
+    __u16 size;                     // whole record in bytes
+    __u16 flags;
+};
+
+// Captured arguments, enabled per syscall with IOCTL_SET_CAPTURE
+#define SM_PATH_MAX 256
+
+struct sm_event_args {
+    __s32 fd;                       // openat: dirfd
+    __u32 flags;                    // openat and mmap flags
+    __u64 count;                    // read/write byte count, mmap length, openat mode
+    __u16 path_len;                 // bytes of path including the NUL, 0 if none
+    __u16 reserved[3];
+    char path[];                    // openat and execve
+};
+
+// Coalesced record: weight consecutive calls of one pid on one fd,
+// timestamp_ns is the first of them
+struct sm_event_span {
+    __u64 last_ns;
+    __u64 bytes;                    // read/write byte counts summed
+    __s32 fd;
+    __u32 reserved;
+};
+
+#define SM_EVENT_MAX_SIZE \
+    round_up(sizeof(struct sm_event) + sizeof(struct sm_event_args) + SM_PATH_MAX, \
+             sizeof(struct sm_event))
+
+// Ring header page shared with userspace. The module only writes head
+// and dropped, the consumer only writes tail.
+struct sm_ring_header {
+    __u64 head;
+    __u8 pad1[56];
+    __u64 tail;
+    __u8 pad2[56];
+    __u64 dropped;
+    __u32 data_size;
+    __u32 record_size;              // records are multiples of this size
+};
+
+struct sm_ring_info {
+    __u32 nr_cpus;
+    __u32 mmap_size;
+    __u32 data_size;
+    __u32 record_size;
+};
+
+// openat path filter: patterns separated by NULs. A pattern matches the
+// paths that start with it, '*' matches within one path component and
+// '?' any one character but '/'.
+#define SM_PATHS_MAX_BYTES 16384
+
+struct sm_path_filter {
+    __u32 size;                     // bytes at patterns, 0 removes the filter
+    __u32 reserved;
+    __u64 patterns;                 // user pointer
+};
+
+// Patterns are compiled into a trie, each node's literal edges sorted by
+// character in one shared array. Wildcards hang off a node as the any
+// and star children, 0 meaning none since the root is nobody's child.
+#define SM_TRIE_ACCEPT 0x1
+#define SM_TRIE_STAR 0x2            // loops on any character but '/'
+#define SM_TRIE_MAX_ACTIVE 16
+
+struct sm_trie_node {
+    u16 edges;
+    u8 nr_edges;
+    u8 flags;
+    u16 any;
+    u16 star;
+};
+
+struct sm_trie_edge {
+    u8 ch;
+    u16 node;
+};
+
+struct sm_trie {
+    struct sm_trie_node *nodes;
+    struct sm_trie_edge *edges;
+    struct rcu_head rcu;
+};
+
+// cgroup v2 targets, by the cgroup id (inode number of its directory).
+// With SM_CGROUP_DESCENDANTS the whole subtree below it is targeted.
+#define SM_CGROUP_DESCENDANTS 0x1
+
+struct sm_cgroup_target {
+    __u64 id;
+    __u32 flags;
+    __u32 reserved;
+};
+
+// Event sampling: emit one in ratio calls of each syscall and at most
+// max_rate events per second per CPU, 0 disables the rate limit.
+struct sm_sampling {
+    __u32 ratio;
+    __u32 max_rate;
+};
+
+// The whole configuration in one ioctl. Targets and the path, FSM and
+// throttle tables are sized by userspace and keep their own ioctls.
+#define SM_CONFIG_VERSION 1
+#define SM_CONFIG_RESTART 0x1       // setting the current mode again starts it over
+
+struct sm_monitor_config {
+    __u32 version;                  // SM_CONFIG_VERSION
+    __u32 mode;
+    __u32 syscall_mask;             // syscalls of LOG, BLOCK and LATENCY mode
+    __u32 capture_mask;             // syscalls whose arguments are recorded
+    struct sm_sampling sampling;
+    __u32 flags;
+    __u32 coalesce_usecs;           // merge repeated calls for up to this long, 0 off
+};
+
+// Per-open-file subscription: after IOCTL_SUBSCRIBE, read, poll and mmap
+// of that file use its own rings, filled with the matching calls whatever
+// the global mode is. Subscribers only observe, config.mode is MODE_LOG.
+#define SM_SUB_MAX_TGIDS 16
+
+struct sm_subscription {
+    struct sm_monitor_config config;
+    __u64 cgroup_id;                // this cgroup and its descendants, 0 for any
+    __u32 nr_tgids;                 // processes in tgids, 0 for any
+    __u32 reserved;
+    __s32 tgids[SM_SUB_MAX_TGIDS];
+};
+
+// The active configuration, never changed once published: writers
+// publish a modified copy and handlers load the pointer once per call
+struct sm_config {
+    int mode;
+    u32 syscall_mask;
+    u32 capture_mask;
+    u32 sample_ratio;
+    u32 max_rate;
+    u64 sample_interval_ns;         // per-CPU rate limit, 0 for none
+    u64 sample_limit_ns;
+    u64 coalesce_ns;
+    struct rcu_head rcu;
+};
+
+// Reader wakeup coalescing: wake after events records or usecs microseconds
+struct sm_wakeup {
+    __u32 events;
+    __u32 usecs;
+};
+
+// In-kernel FSM: transition table compiled by userspace. next[s][syscall]
+// is the target state, or SM_FSM_NONE if the syscall is ignored in s.
+#define SM_FSM_MAX_STATES 64
+#define SM_FSM_NONE 0xff
+
+// FSM scopes: one machine-wide cursor, or one cursor per process/thread
+#define SM_FSM_GLOBAL 0
+#define SM_FSM_PER_TGID 1
+#define SM_FSM_PER_PID 2
+
+struct sm_fsm_table {
+    __u32 num_states;
+    __u32 start_state;
+    __u32 scope;
+    __u32 reserved;
+    __u64 accept_mask;              // bit s set if state s is accepting
+    __u8 next[SM_FSM_MAX_STATES][SM_NR_SYSCALLS];
+};
+
+// Several automata stepped side by side, each usually the product of
+// many rules. Their states share one numbering, so an event names a
+// state and accept[state] holds the rules that accept on entering it.
+#define SM_FSM_MAX_AUTOMATA 8
+#define SM_FSM_SET_MAX_STATES 8192
+#define SM_FSM_SET_NONE 0xffff
+
+struct sm_fsm_set {
+    __u32 num_states;               // over all automata, 0 removes the FSM
+    __u32 num_automata;
+    __u32 scope;
+    __u32 reserved;
+    __u32 start[SM_FSM_MAX_AUTOMATA];
+    __u64 next;                     // user pointer, __u16 [num_states][SM_NR_SYSCALLS]
+    __u64 accept;                   // user pointer, __u64 [num_states] rule bitmaps
+};
+
+// Cursors pack (generation << 32 | state) so a cursor left over from a
+// previous table is recognised and restarted instead of misindexing.
+// Both uploads end up here, an sm_fsm_table as a single automaton.
+struct sm_fsm {
+    u32 num_states;
+    u32 num_automata;
+    u32 scope;
+    u32 syscall_mask;               // syscalls with at least one transition
+    u32 gen;
+    u32 start[SM_FSM_MAX_AUTOMATA];
+    atomic64_t state[SM_FSM_MAX_AUTOMATA];  // SM_FSM_GLOBAL cursors
+    u64 *accept;                    // tables follow the struct
+    u16 (*next)[SM_NR_SYSCALLS];    // SM_FSM_SET_NONE if the syscall is ignored
+    struct rcu_head rcu;
+};
+
+// Per-process state, looked up locklessly under RCU. The lock is only
+// taken to insert, evict or remove entries. Eviction is CLOCK: lookups
+// set referenced, the sweep gives referenced entries a second chance.
+#define SM_TSTATE_HASH_BITS 10
+
+struct sm_tstate {
+    struct hlist_node node;
+    struct list_head lru;
+    u32 key;
+    bool referenced;
+    atomic64_t fsm_cursor[SM_FSM_MAX_AUTOMATA];
+    u64 tat[SM_NR_SYSCALLS];        // throttle buckets, only the owning thread touches them
+    struct rcu_head rcu;
+};
+
+// Throttle mode: per-thread token buckets refilled at rate calls/s up to
+// burst tokens. A rate of 0 leaves that syscall unlimited.
+#define SM_THROTTLE_DENY 1          // fail over-limit calls with -EAGAIN
+
+struct sm_throttle_config {
+    __u32 rate[SM_NR_SYSCALLS];
+    __u32 burst[SM_NR_SYSCALLS];
+    __u32 flags;
+    __u32 reserved;
+};
+
+// Buckets are kept in virtual time: tat is when the bucket will be full
+// again, each call moves it one interval on. A call fits while tat stays
+// within burst - 1 intervals of now.
+struct sm_throttle {
+    u64 interval_ns[SM_NR_SYSCALLS];
+    u64 limit_ns[SM_NR_SYSCALLS];
+    u32 syscall_mask;               // syscalls with a rate
+    bool deny;
+    struct rcu_head rcu;
+};
+
+// Always-on counters per mode and syscall, summed over CPUs on request
+struct sm_stat {
+    __u64 calls;
+    __u64 blocked;
+    __u64 throttled;                // over the rate limit, denied or not
+    __u64 dropped;                  // events lost to a full ring
+};
+
+struct sm_stats {
+    struct sm_stat count[SM_NR_MODES][SM_NR_SYSCALLS];
+};
+
+// Latency histograms, summed over CPUs on request. Bucket b counts calls
+// that took [2^(b-1), 2^b) ns, bucket 0 calls that took no time at all.
+#define SM_LAT_BUCKETS 64
+
+struct sm_latency {
+    __u64 buckets[SM_NR_SYSCALLS][SM_LAT_BUCKETS];
+    __u64 total_ns[SM_NR_SYSCALLS];
+    __u64 missed;                   // calls that could not be timed
+};
+
+// Tracepoint backend: entry timestamps waiting for their sys_exit, in a
+// direct-mapped table indexed by pid. key is pid << 32 | syscall id.
+#define SM_INFLIGHT_BITS 12
+
+struct sm_inflight {
+    u64 key;
+    u64 ts;
+};
+
+// Follow-children: tasks forked by a target become targets. Their pids
+// live in an open-addressed table, probed at most SM_FOLLOW_PROBES slots,
+// because sched_process_fork can neither sleep nor allocate.
+#define SM_FOLLOW_BITS 14
+#define SM_FOLLOW_PROBES 8
+#define SM_FOLLOW_DEAD ((u32)-1)    // tombstone left by an exited task
+
+// Attachment backends, chosen at load time with backend=kprobe|tracepoint
+#define SM_BACKEND_KPROBE 0
+#define SM_BACKEND_TRACEPOINT 1
+
+// The tracepoint backend maps syscall numbers to ids through this array
+#define SM_NR_SLOTS 512
+
+// One kprobe per hooked symbol, all sharing handler_pre_syscall, and a
+// kretprobe on the same symbol that times the call in latency mode
+struct sm_probe {
+    const char *symbol;
+    int nr;
+    int syscall_id;
+    struct kprobe kp;
+    bool registered;
+    struct kretprobe rp;
+    bool rp_registered;
+};
+
+// Target sets: immutable open-addressed tables of ids, replaced through
+// RCU on every change so membership tests never take a lock. 0 marks an
+// empty slot, the load factor is kept at or below one half.
+#define SM_IDSET_MAX 65536
+
+struct sm_idset {
+    unsigned int count;
+    unsigned int mask;
+    struct rcu_head rcu;
+    u64 slots[];
+};
+
+// Coalescing: the calls merged so far into the next record of a ring.
+// The key is pid, syscall and fd, open and execve are never merged.
+#define SM_COALESCE_MASK (SM_SYSCALL_MASK_ALL & ~(BIT(SYSCALL_OPEN) | BIT(SYSCALL_EXECVE)))
+
+struct sm_coalesce {
+    u64 first_ns;
+    u64 last_ns;
+    u64 bytes;
+    u32 count;
+    u32 pid;
+    u32 tgid;
+    s32 fd;
+    s8 syscall_id;                  // -1 when nothing is pending
+    u8 mode;
+};
+
+struct sm_ring {
+    void *base;                     // vmalloc_user area, header page first
+    struct sm_ring_header *hdr;
+    char *data;
+    u64 head;                       // private copy, never read back from userspace
+    local_t pending;                // records published since the last wakeup
+    wait_queue_head_t *wait;        // readers of the stream the ring belongs to
+    struct irq_work wake_work;
+    struct hrtimer wake_timer;
+    char path_buf[SM_PATH_MAX];     // openat path filter scratch
+    u32 sample_countdown[SM_NR_SYSCALLS];
+    u32 sample_skipped[SM_NR_SYSCALLS];  // calls since the last record, per syscall
+    u64 sample_tat;                 // rate limit bucket, as in throttle mode
+    struct sm_coalesce coalesce;
+    struct hrtimer coalesce_timer;  // flushes the pending record when its window ends
+};
+
+// Per-CPU rings and their readers: the device's own, and one per
+// subscribed open file
+struct sm_stream {
+    struct sm_ring __percpu *rings;
+    wait_queue_head_t wait;
+    struct mutex read_lock;
+};
+
+struct sm_sub {
+    struct list_head node;          // on sm_subs
+    struct sm_config *cfg;
+    u64 cgroup_id;
+    u32 nr_tgids;
+    pid_t tgids[SM_SUB_MAX_TGIDS];
+    struct sm_stream stream;
+};
+
+static struct sm_config sm_config_default = {
+    .mode = MODE_OFF,
+    .syscall_mask = BIT(SYSCALL_OPEN),
+    .sample_ratio = 1,
+};
+static struct sm_config __rcu *active_config = RCU_INITIALIZER(&sm_config_default);
+static struct sm_idset __rcu *target_pids;      // NULL matches every process
+static struct sm_idset __rcu *target_tgids;
+static struct sm_idset __rcu *target_cgroups;
+static struct sm_idset __rcu *target_cgroup_trees;
+static DEFINE_MUTEX(sm_target_lock);
+static u32 sm_followed[1 << SM_FOLLOW_BITS];
+
+// Probes are only armed for syscalls the current mode needs, and the
+// per-call mode and target checks are patched in with static keys.
+static DEFINE_MUTEX(sm_config_lock);
+static DEFINE_STATIC_KEY_FALSE(sm_key_targets);
+static DEFINE_STATIC_KEY_FALSE(sm_key_fsm);
+static DEFINE_STATIC_KEY_FALSE(sm_key_block);
+static DEFINE_STATIC_KEY_FALSE(sm_key_latency);
+static DEFINE_STATIC_KEY_FALSE(sm_key_throttle);
+static DEFINE_STATIC_KEY_FALSE(sm_key_sample);
+static DEFINE_STATIC_KEY_FALSE(sm_key_paths);
+static DEFINE_STATIC_KEY_FALSE(sm_key_follow);
+static DEFINE_STATIC_KEY_FALSE(sm_key_subs);
 
 static int major_number;
 static struct class* syscall_class = NULL;
 static struct device* syscall_device = NULL;
+static struct proc_dir_entry *sm_proc;
+
+static struct sm_probe sm_probes[] = {
+    { "__x64_sys_openat", __NR_openat, SYSCALL_OPEN },
+    { "__x64_sys_read", __NR_read, SYSCALL_READ },
+    { "__x64_sys_write", __NR_write, SYSCALL_WRITE },
+    { "__x64_sys_close", __NR_close, SYSCALL_CLOSE },
+    { "__x64_sys_mmap", __NR_mmap, SYSCALL_MMAP },
+    { "__x64_sys_connect", __NR_connect, SYSCALL_CONNECT },
+    { "__x64_sys_accept", __NR_accept, SYSCALL_ACCEPT },
+    { "__x64_sys_accept4", __NR_accept4, SYSCALL_ACCEPT },
+    { "__x64_sys_execve", __NR_execve, SYSCALL_EXECVE },
+};
+
+static char *backend = "kprobe";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Attachment backend: kprobe or tracepoint (raw sys_enter)");
+
+static int sm_backend = SM_BACKEND_KPROBE;
+static s8 sm_nr_to_id[SM_NR_SLOTS];
+static u32 sm_armed_mask;           // tracepoint backend: ids to handle
+static struct tracepoint *tp_sys_enter;
+static bool sm_sys_enter_registered;
+static struct tracepoint *tp_sys_exit;
+static bool sm_sys_exit_registered;
+
+static DEFINE_PER_CPU(struct sm_ring, sm_rings);
+static struct sm_stream sm_stream = {
+    .rings = &sm_rings,
+    .wait = __WAIT_QUEUE_HEAD_INITIALIZER(sm_stream.wait),
+    .read_lock = __MUTEX_INITIALIZER(sm_stream.read_lock),
+};
+static LIST_HEAD(sm_subs);          // RCU list, changed under sm_config_lock
+static u32 sm_sub_mask;             // union of the subscribers' syscalls
+static u32 sm_mode_mask;            // syscalls the global mode handles
+static unsigned int wake_events = 1;
+static unsigned int wake_usecs = 0;
+
+static DEFINE_PER_CPU_ALIGNED(struct sm_stats, sm_counters);
+static DEFINE_PER_CPU(struct sm_latency, sm_lat);
+static struct sm_inflight sm_inflight[1 << SM_INFLIGHT_BITS];
+
+static struct sm_throttle __rcu *active_throttle;
+static struct sm_trie __rcu *active_paths;
+static struct sm_fsm __rcu *active_fsm;
+static DEFINE_MUTEX(sm_fsm_lock);
+static u32 fsm_gen;
+
+static DEFINE_HASHTABLE(sm_tstate_hash, SM_TSTATE_HASH_BITS);
+static DEFINE_SPINLOCK(sm_tstate_lock);
+static LIST_HEAD(sm_tstate_lru);
+static unsigned int sm_tstate_count;
+
+static unsigned int cursor_mem_kb = 1024;
+module_param(cursor_mem_kb, uint, 0644);
+MODULE_PARM_DESC(cursor_mem_kb, "Memory cap for per-process state (FSM cursors, throttle buckets) in KiB");
+
+static struct tracepoint *tp_sched_exit;
+static struct tracepoint *tp_sched_fork;
+
+// IOCTL commands
+#define IOCTL_SET_MODE _IOW('s', 1, int)
+#define IOCTL_SET_SYSCALL _IOW('s', 2, int)
+#define IOCTL_SET_PID _IOW('s', 3, pid_t)
+#define IOCTL_GET_RING_INFO _IOR('s', 4, struct sm_ring_info)
+#define IOCTL_SET_WAKEUP _IOW('s', 5, struct sm_wakeup)
+#define IOCTL_SET_FSM _IOW('s', 6, struct sm_fsm_table)
+#define IOCTL_ADD_PID _IOW('s', 7, pid_t)
+#define IOCTL_DEL_PID _IOW('s', 8, pid_t)
+#define IOCTL_ADD_TGID _IOW('s', 9, pid_t)
+#define IOCTL_DEL_TGID _IOW('s', 10, pid_t)
+#define IOCTL_CLEAR_TARGETS _IO('s', 11)
+#define IOCTL_SET_SYSCALL_MASK _IOW('s', 12, __u32)
+#define IOCTL_GET_LATENCY _IOR('s', 13, struct sm_latency)
+#define IOCTL_GET_STATS _IOR('s', 14, struct sm_stats)
+#define IOCTL_SET_THROTTLE _IOW('s', 15, struct sm_throttle_config)
+#define IOCTL_SET_SAMPLING _IOW('s', 16, struct sm_sampling)
+#define IOCTL_SET_CAPTURE _IOW('s', 17, __u32)
+#define IOCTL_SET_PATHS _IOW('s', 18, struct sm_path_filter)
+#define IOCTL_ADD_CGROUP _IOW('s', 19, struct sm_cgroup_target)
+#define IOCTL_DEL_CGROUP _IOW('s', 20, struct sm_cgroup_target)
+#define IOCTL_SET_FOLLOW _IOW('s', 21, __u32)
+#define IOCTL_SET_CONFIG _IOW('s', 22, struct sm_monitor_config)
+#define IOCTL_GET_CONFIG _IOR('s', 23, struct sm_monitor_config)
+#define IOCTL_SUBSCRIBE _IOW('s', 24, struct sm_subscription)
+#define IOCTL_SET_FSM_SET _IOW('s', 25, struct sm_fsm_set)
+
+#define sm_stat_inc(cfg, id, field) \
+    this_cpu_inc(sm_counters.count[(cfg)->mode][id].field)
+
+static void sm_wake_work(struct irq_work *work)
+{
+    wake_up_interruptible(container_of(work, struct sm_ring, wake_work)->wait);
+}
+
+static enum hrtimer_restart sm_wake_timer(struct hrtimer *timer)
+{
+    struct sm_ring *ring = container_of(timer, struct sm_ring, wake_timer);
+    
+    local_set(&ring->pending, 0);
+    wake_up_interruptible(ring->wait);
+    return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart sm_coalesce_timer(struct hrtimer *timer);
+
+// Allocate one ring per possible CPU
+static int sm_rings_alloc(struct sm_stream *st)
+{
+    int cpu;
+    
+    BUILD_BUG_ON(SM_RING_DATA_SIZE % sizeof(struct sm_event));
+    
+    for_each_possible_cpu(cpu) {
+        struct sm_ring *ring = per_cpu_ptr(st->rings, cpu);
+        
+        local_set(&ring->pending, 0);
+        ring->wait = &st->wait;
+        ring->coalesce.syscall_id = -1;
+        hrtimer_setup(&ring->coalesce_timer, sm_coalesce_timer, CLOCK_MONOTONIC,
+                      HRTIMER_MODE_REL_HARD);
+        init_irq_work(&ring->wake_work, sm_wake_work);
+        hrtimer_setup(&ring->wake_timer, sm_wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    }
+    
+    for_each_possible_cpu(cpu) {
+        struct sm_ring *ring = per_cpu_ptr(st->rings, cpu);
+        
+        ring->base = vmalloc_user(SM_RING_MMAP_SIZE);
+        if (!ring->base)
+            return -ENOMEM;
+        ring->hdr = ring->base;
+        ring->data = ring->base + PAGE_SIZE;
+        ring->head = 0;
+        ring->hdr->data_size = SM_RING_DATA_SIZE;
+        ring->hdr->record_size = sizeof(struct sm_event);
+    }
+    
+    return 0;
+}
+
+static void sm_rings_free(struct sm_stream *st)
+{
+    int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        struct sm_ring *ring = per_cpu_ptr(st->rings, cpu);
+        
+        hrtimer_cancel(&ring->coalesce_timer);
+        hrtimer_cancel(&ring->wake_timer);
+        irq_work_sync(&ring->wake_work);
+        vfree(ring->base);
+        ring->base = NULL;
+    }
+}
+
+// Wake sleeping readers once enough records are pending, or arm the
+// timeout on the first record of a batch. The wakeup itself is deferred
+// to irq_work so the handler never takes the wait queue lock.
+static void sm_ring_notify(struct sm_ring *ring)
+{
+    unsigned int usecs;
+    
+    if (local_inc_return(&ring->pending) >= READ_ONCE(wake_events)) {
+        local_set(&ring->pending, 0);
+        if (wq_has_sleeper(ring->wait))
+            irq_work_queue(&ring->wake_work);
+        return;
+    }
+    
+    usecs = READ_ONCE(wake_usecs);
+    if (usecs && !hrtimer_is_queued(&ring->wake_timer))
+        hrtimer_start(&ring->wake_timer, ns_to_ktime((u64)usecs * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL_PINNED);
+}
+
+static bool sm_events_available(struct sm_stream *st)
+{
+    int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        struct sm_ring_header *hdr = per_cpu_ptr(st->rings, cpu)->hdr;
+        
+        if (smp_load_acquire(&hdr->head) != READ_ONCE(hdr->tail))
+            return true;
+    }
+    
+    return false;
+}
+
+// Reserve size contiguous bytes in this CPU's ring, or count a drop and
+// return NULL. A record that would cross the ring end is preceded by a
+// filler. Both backends call this with preemption disabled, and the
+// coalescing timer in hardirq context on the ring's CPU, so writers keep
+// interrupts off from reserve to commit and each ring has exactly one
+// producer at a time.
+static struct sm_event *sm_event_reserve(struct sm_ring *ring, int mode, size_t size,
+                                         int syscall_id, int outcome)
+{
+    struct sm_ring_header *hdr = ring->hdr;
+    struct sm_event *ev;
+    size_t off = ring->head & (SM_RING_DATA_SIZE - 1);
+    size_t pad = off + size > SM_RING_DATA_SIZE ? SM_RING_DATA_SIZE - off : 0;
+    u64 tail = smp_load_acquire(&hdr->tail);
+    
+    if (ring->head - tail + pad + size > SM_RING_DATA_SIZE) {
+        WRITE_ONCE(hdr->dropped, hdr->dropped + 1);
+        this_cpu_inc(sm_counters.count[mode][syscall_id].dropped);
+        return NULL;
+    }
+    
+    if (pad) {
+        ev = (struct sm_event *)(ring->data + off);
+        ev->size = pad;
+        ev->flags = SM_EVENT_PAD;
+        ring->head += pad;
+        off = 0;
+    }
+    
+    ev = (struct sm_event *)(ring->data + off);
+    ev->timestamp_ns = ktime_get_ns();
+    ev->pid = current->pid;
+    ev->tgid = current->tgid;
+    ev->syscall_id = syscall_id;
+    ev->mode = mode;
+    ev->outcome = outcome;
+    ev->state_from = 0;
+    ev->state_to = 0;
+    ev->weight = 1;
+    ev->size = size;
+    ev->flags = 0;
+    
+    return ev;
+}
+
+// Publish the record returned by sm_event_reserve(), size may have shrunk.
+// It is passed in rather than read back from the shared mapping.
+static void sm_event_commit(struct sm_ring *ring, size_t size)
+{
+    ring->head += size;
+    smp_store_release(&ring->hdr->head, ring->head);
+    
+    sm_ring_notify(ring);
+}
+
+// Decide before building a record whether this call gets one. Skipped
+// calls are folded into the weight of the next record of the syscall on
+// this CPU, so summing weights gives back the true call counts.
+static u32 sm_sample(struct sm_ring *ring, const struct sm_config *cfg, int syscall_id)
+{
+    u32 ratio = cfg->sample_ratio;
+    u64 interval = cfg->sample_interval_ns;
+    u64 now, tat;
+    u32 weight;
+    
+    if (ratio > 1) {
+        if (ring->sample_countdown[syscall_id]) {
+            ring->sample_countdown[syscall_id]--;
+            goto skip;
+        }
+        ring->sample_countdown[syscall_id] = ratio - 1;
+    }
+    
+    if (interval) {
+        now = ktime_get_ns();
+        tat = max(ring->sample_tat, now);
+        if (tat - now > cfg->sample_limit_ns)
+            goto skip;
+        ring->sample_tat = tat + interval;
+    }
+    
+    weight = ring->sample_skipped[syscall_id] + 1;
+    ring->sample_skipped[syscall_id] = 0;
+    return weight;
+skip:
+    ring->sample_skipped[syscall_id]++;
+    return 0;
+}
+
+// Fill the argument section from the user registers and return the final
+// record size. Paths go straight into the record with the non-faulting
+// copy, one that faults is left empty.
+static size_t sm_capture_args(struct sm_event *ev, int syscall_id, struct pt_regs *uregs)
+{
+    struct sm_event_args *args = (struct sm_event_args *)(ev + 1);
+    const char __user *path = NULL;
+    unsigned long a[6];
+    long len = 0;
+    
+    syscall_get_arguments(current, uregs, a);
+    memset(args, 0, sizeof(*args));
+    
+    switch (syscall_id) {
+        case SYSCALL_OPEN:          // openat(dfd, filename, flags, mode)
+            args->fd = a[0];
+            path = (const char __user *)a[1];
+            args->flags = a[2];
+            args->count = a[3];
+            break;
+            
+        case SYSCALL_READ:
+        case SYSCALL_WRITE:
+            args->fd = a[0];
+            args->count = a[2];
+            break;
+            
+        case SYSCALL_MMAP:          // mmap(addr, len, prot, flags, fd, off)
+            args->fd = a[4];
+            args->count = a[1];
+            args->flags = a[3];
+            break;
+            
+        case SYSCALL_EXECVE:
+            args->fd = -1;
+            path = (const char __user *)a[0];
+            break;
+            
+        default:                    // close, connect, accept
+            args->fd = a[0];
+            break;
+    }
+    
+    if (path) {
+        len = strncpy_from_user_nofault(args->path, path, SM_PATH_MAX);
+        if (len < 0)
+            len = 0;
+        else if (len == SM_PATH_MAX)
+            args->path[SM_PATH_MAX - 1] = '\0';      // truncated
+        args->path_len = len;
+    }
+    
+    ev->flags |= SM_EVENT_ARGS;
+    ev->size = round_up(sizeof(*ev) + sizeof(*args) + len, sizeof(*ev));
+    return ev->size;
+}
+
+// Write out the pending coalesced record, interrupts are off
+static void sm_coalesce_flush(struct sm_ring *ring)
+{
+    struct sm_coalesce *c = &ring->coalesce;
+    struct sm_event_span *span;
+    struct sm_event *ev;
+    size_t size = round_up(sizeof(*ev) + sizeof(*span), sizeof(*ev));
+    
+    if (c->syscall_id < 0)
+        return;
+    
+    ev = sm_event_reserve(ring, c->mode, size, c->syscall_id, OUTCOME_LOGGED);
+    if (ev) {
+        ev->timestamp_ns = c->first_ns;
+        ev->pid = c->pid;
+        ev->tgid = c->tgid;
+        ev->weight = c->count;
+        ev->flags = SM_EVENT_SPAN;
+        span = (struct sm_event_span *)(ev + 1);
+        span->last_ns = c->last_ns;
+        span->bytes = c->bytes;
+        span->fd = c->fd;
+        span->reserved = 0;
+        sm_event_commit(ring, size);
+    }
+    c->syscall_id = -1;
+}
+
+static enum hrtimer_restart sm_coalesce_timer(struct hrtimer *timer)
+{
+    sm_coalesce_flush(container_of(timer, struct sm_ring, coalesce_timer));
+    return HRTIMER_NORESTART;
+}
+
+// Fold the call into the pending record if pid, syscall and fd match and
+// its window is still open. Otherwise the pending record goes out and the
+// call starts a new one. The timer makes sure it leaves within the window
+// even if no other call comes; one still queued for an earlier record
+// only flushes this one early. Interrupts are off.
+static void sm_coalesce(struct sm_ring *ring, const struct sm_config *cfg, int syscall_id,
+                        struct pt_regs *uregs)
+{
+    struct sm_coalesce *c = &ring->coalesce;
+    u64 now = ktime_get_ns();
+    unsigned long a[6];
+    u64 bytes = 0;
+    s32 fd;
+    
+    syscall_get_arguments(current, uregs, a);
+    fd = syscall_id == SYSCALL_MMAP ? a[4] : a[0];
+    if (syscall_id == SYSCALL_READ || syscall_id == SYSCALL_WRITE)
+        bytes = a[2];
+    
+    if (c->syscall_id == syscall_id && c->pid == current->pid && c->fd == fd &&
+        now - c->first_ns < cfg->coalesce_ns && c->count < U32_MAX) {
+        c->count++;
+        c->bytes += bytes;
+        c->last_ns = now;
+        return;
+    }
+    
+    sm_coalesce_flush(ring);
+    c->first_ns = now;
+    c->last_ns = now;
+    c->bytes = bytes;
+    c->count = 1;
+    c->pid = current->pid;
+    c->tgid = current->tgid;
+    c->fd = fd;
+    c->syscall_id = syscall_id;
+    c->mode = cfg->mode;
+    if (!hrtimer_is_queued(&ring->coalesce_timer))
+        hrtimer_start(&ring->coalesce_timer, ns_to_ktime(cfg->coalesce_ns),
+                      HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+// uregs are the user registers of the call, NULL when not available
+static void sm_emit_to(struct sm_ring *ring, const struct sm_config *cfg, int syscall_id,
+                       int outcome, struct pt_regs *uregs)
+{
+    struct sm_event *ev;
+    size_t size = sizeof(*ev);
+    bool capture = uregs && (cfg->capture_mask & BIT(syscall_id));
+    unsigned long flags;
+    u32 weight = 1;
+    
+    // merged calls already say how many they are, so they skip sampling
+    if (cfg->coalesce_ns && outcome == OUTCOME_LOGGED && uregs &&
+        (SM_COALESCE_MASK & BIT(syscall_id))) {
+        local_irq_save(flags);
+        sm_coalesce(ring, cfg, syscall_id, uregs);
+        local_irq_restore(flags);
+        return;
+    }
+    
+    if (static_branch_unlikely(&sm_key_sample)) {
+        weight = sm_sample(ring, cfg, syscall_id);
+        if (!weight)
+            return;
+    }
+    
+    // only calls with a path reserve room for one
+    if (capture)
+        size = syscall_id == SYSCALL_OPEN || syscall_id == SYSCALL_EXECVE ? SM_EVENT_MAX_SIZE :
+               round_up(sizeof(*ev) + sizeof(struct sm_event_args), sizeof(*ev));
+    
+    local_irq_save(flags);
+    // keep the ring in time order
+    sm_coalesce_flush(ring);
+    ev = sm_event_reserve(ring, cfg->mode, size, syscall_id, outcome);
+    if (ev) {
+        ev->weight = weight;
+        if (capture)
+            size = sm_capture_args(ev, syscall_id, uregs);
+        sm_event_commit(ring, size);
+    }
+    local_irq_restore(flags);
+}
+
+static void sm_emit_event(const struct sm_config *cfg, int syscall_id, int outcome,
+                          struct pt_regs *uregs)
+{
+    sm_emit_to(this_cpu_ptr(&sm_rings), cfg, syscall_id, outcome, uregs);
+}
+
+static bool sm_idset_contains(const struct sm_idset *set, u64 id)
+{
+    unsigned int i = hash_64(id, 32) & set->mask;
+    
+    while (set->slots[i]) {
+        if (set->slots[i] == id)
+            return true;
+        i = (i + 1) & set->mask;
+    }
+    
+    return false;
+}
+
+static void sm_idset_insert(struct sm_idset *set, u64 id)
+{
+    unsigned int i = hash_64(id, 32) & set->mask;
+    
+    while (set->slots[i]) {
+        if (set->slots[i] == id)
+            return;
+        i = (i + 1) & set->mask;
+    }
+    set->slots[i] = id;
+    set->count++;
+}
+
+// Copy of old with id added or removed, NULL once the set is empty
+static struct sm_idset *sm_idset_update(const struct sm_idset *old, u64 id, bool add)
+{
+    unsigned int count = (old ? old->count : 0) + add;
+    unsigned int size, i;
+    struct sm_idset *set;
+    
+    if (count > SM_IDSET_MAX)
+        return ERR_PTR(-ENOSPC);
+    if (!add && (!old || count <= 1))
+        return (old && sm_idset_contains(old, id)) ? NULL : ERR_PTR(-ENOENT);
+    
+    size = roundup_pow_of_two(max(2 * count, 16U));
+    set = kvzalloc(struct_size(set, slots, size), GFP_KERNEL);
+    if (!set)
+        return ERR_PTR(-ENOMEM);
+    set->mask = size - 1;
+    
+    for (i = 0; old && i <= old->mask; i++) {
+        if (old->slots[i] && (add || old->slots[i] != id))
+            sm_idset_insert(set, old->slots[i]);
+    }
+    if (add)
+        sm_idset_insert(set, id);
+    
+    if (!add && old && set->count == old->count) {
+        kvfree(set);
+        return ERR_PTR(-ENOENT);
+    }
+    
+    return set;
+}
+
+static void sm_idset_free_rcu(struct rcu_head *head)
+{
+    kvfree(container_of(head, struct sm_idset, rcu));
+}
+
+static void sm_idset_release(struct sm_idset *set)
+{
+    if (set)
+        call_rcu(&set->rcu, sm_idset_free_rcu);
+}
+
+// Target checks are only patched in while some target set is non-empty
+static void sm_target_key_update(void)
+{
+    lockdep_assert_held(&sm_target_lock);
+    
+    if (rcu_access_pointer(target_pids) || rcu_access_pointer(target_tgids) ||
+        rcu_access_pointer(target_cgroups) || rcu_access_pointer(target_cgroup_trees))
+        static_branch_enable(&sm_key_targets);
+    else
+        static_branch_disable(&sm_key_targets);
+}
+
+// Add or remove one id and publish the new set
+static int sm_target_update(struct sm_idset __rcu **setp, u64 id, bool add)
+{
+    struct sm_idset *old, *set;
+    
+    if (!id)
+        return -EINVAL;
+    
+    mutex_lock(&sm_target_lock);
+    old = rcu_dereference_protected(*setp, lockdep_is_held(&sm_target_lock));
+    set = sm_idset_update(old, id, add);
+    if (IS_ERR(set)) {
+        mutex_unlock(&sm_target_lock);
+        return PTR_ERR(set);
+    }
+    rcu_assign_pointer(*setp, set);
+    sm_target_key_update();
+    mutex_unlock(&sm_target_lock);
+    
+    sm_idset_release(old);
+    return 0;
+}
+
+static bool sm_follow_contains(u32 pid)
+{
+    u32 i = hash_32(pid, SM_FOLLOW_BITS);
+    u32 n, slot;
+    
+    for (n = 0; n < SM_FOLLOW_PROBES; n++, i = (i + 1) & (ARRAY_SIZE(sm_followed) - 1)) {
+        slot = READ_ONCE(sm_followed[i]);
+        if (slot == pid)
+            return true;
+        if (!slot)
+            return false;
+    }
+    
+    return false;
+}
+
+// Claim the first free or dead slot. A live pid is in the table at most
+// once, since it is only added by its own fork and removed at its exit.
+static void sm_follow_add(u32 pid)
+{
+    u32 i = hash_32(pid, SM_FOLLOW_BITS);
+    u32 n, slot;
+    
+    for (n = 0; n < SM_FOLLOW_PROBES; n++, i = (i + 1) & (ARRAY_SIZE(sm_followed) - 1)) {
+        slot = READ_ONCE(sm_followed[i]);
+        if (slot == pid)
+            return;
+        if ((!slot || slot == SM_FOLLOW_DEAD) && cmpxchg(&sm_followed[i], slot, pid) == slot)
+            return;
+    }
+    
+    printk_ratelimited(KERN_WARNING "SYSCALL_MONITOR: Follow table full, PID %u not followed\n", pid);
+}
+
+static void sm_follow_remove(u32 pid)
+{
+    u32 i = hash_32(pid, SM_FOLLOW_BITS);
+    u32 n, slot;
+    
+    for (n = 0; n < SM_FOLLOW_PROBES; n++, i = (i + 1) & (ARRAY_SIZE(sm_followed) - 1)) {
+        slot = READ_ONCE(sm_followed[i]);
+        if (!slot)
+            return;
+        if (slot == pid && cmpxchg(&sm_followed[i], pid, SM_FOLLOW_DEAD) == pid)
+            return;
+    }
+}
+
+// Caller made sure no fork probe can still be adding
+static void sm_follow_flush(void)
+{
+    int i;
+    
+    for (i = 0; i < ARRAY_SIZE(sm_followed); i++)
+        WRITE_ONCE(sm_followed[i], 0);
+}
+
+static void sm_follow_set(bool on)
+{
+    mutex_lock(&sm_target_lock);
+    if (on) {
+        static_branch_enable(&sm_key_follow);
+    } else if (static_branch_unlikely(&sm_key_follow)) {
+        static_branch_disable(&sm_key_follow);
+        synchronize_rcu();          // forks that saw the key are done
+        sm_follow_flush();
+    }
+    mutex_unlock(&sm_target_lock);
+}
+
+// Replace every target set in one step: pids becomes the PID set and the
+// TGID and cgroup sets are emptied. With pids NULL no targets remain.
+static void sm_target_replace(struct sm_idset *pids)
+{
+    struct sm_idset __rcu **sets[] = {
+        &target_pids, &target_tgids, &target_cgroups, &target_cgroup_trees
+    };
+    struct sm_idset *old[ARRAY_SIZE(sets)];
+    int i;
+    
+    mutex_lock(&sm_target_lock);
+    for (i = 0; i < ARRAY_SIZE(sets); i++)
+        old[i] = rcu_replace_pointer(*sets[i], i ? NULL : pids, lockdep_is_held(&sm_target_lock));
+    sm_target_key_update();
+    mutex_unlock(&sm_target_lock);
+    
+    for (i = 0; i < ARRAY_SIZE(sets); i++)
+        sm_idset_release(old[i]);
+    
+    // followed children belonged to the old targets. With the targets
+    // key off the fork probe adds nothing new.
+    if (static_branch_unlikely(&sm_key_follow)) {
+        synchronize_rcu();
+        sm_follow_flush();
+    }
+}
+
+static void sm_target_clear(void)
+{
+    sm_target_replace(NULL);
+}
+
+// Is the cgroup of current, or with trees any of its ancestors, targeted?
+// Caller holds rcu_read_lock(), which also keeps the cgroup alive.
+static bool sm_cgroup_match(struct sm_idset *cgroups, struct sm_idset *trees)
+{
+    struct cgroup *cgrp = task_dfl_cgroup(current);
+    int level;
+    
+    if (cgroups && sm_idset_contains(cgroups, cgroup_id(cgrp)))
+        return true;
+    if (!trees)
+        return false;
+    
+    for (level = cgrp->level; level >= 0; level--) {
+        if (sm_idset_contains(trees, cgroup_id(cgroup_ancestor(cgrp, level))))
+            return true;
+    }
+    
+    return false;
+}
+
+// Is current targeted? With no target sets every process is.
+static bool sm_target_match(void)
+{
+    struct sm_idset *pids, *tgids, *cgroups, *trees;
+    bool match;
+    
+    rcu_read_lock();
+    pids = rcu_dereference(target_pids);
+    tgids = rcu_dereference(target_tgids);
+    cgroups = rcu_dereference(target_cgroups);
+    trees = rcu_dereference(target_cgroup_trees);
+    if (!pids && !tgids && !cgroups && !trees)
+        match = true;
+    else
+        match = (pids && sm_idset_contains(pids, current->pid)) ||
+                (tgids && sm_idset_contains(tgids, current->tgid)) ||
+                ((cgroups || trees) && sm_cgroup_match(cgroups, trees)) ||
+                (static_branch_unlikely(&sm_key_follow) && sm_follow_contains(current->pid));
+    rcu_read_unlock();
+    
+    return match;
+}
+
+static void sm_tstate_free_rcu(struct sm_tstate *ts)
+{
+    hash_del_rcu(&ts->node);
+    list_del(&ts->lru);
+    sm_tstate_count--;
+    kfree_rcu(ts, rcu);
+}
+
+// Drop one entry, sweeping the clock hand past referenced ones
+static void sm_tstate_evict_one(void)
+{
+    struct sm_tstate *ts;
+    unsigned int budget = 2 * sm_tstate_count;
+    
+    lockdep_assert_held(&sm_tstate_lock);
+    
+    while (budget-- && !list_empty(&sm_tstate_lru)) {
+        ts = list_first_entry(&sm_tstate_lru, struct sm_tstate, lru);
+        if (READ_ONCE(ts->referenced)) {
+            WRITE_ONCE(ts->referenced, false);
+            list_move_tail(&ts->lru, &sm_tstate_lru);
+            continue;
+        }
+        sm_tstate_free_rcu(ts);
+        return;
+    }
+}
+
+static struct sm_tstate *sm_tstate_lookup(u32 key)
+{
+    struct sm_tstate *ts;
+    
+    hash_for_each_possible_rcu(sm_tstate_hash, ts, node, key) {
+        if (ts->key == key) {
+            if (!READ_ONCE(ts->referenced))
+                WRITE_ONCE(ts->referenced, true);
+            return ts;
+        }
+    }
+    
+    return NULL;
+}
+
+// Insert a new entry from the handler, caller holds rcu_read_lock()
+static struct sm_tstate *sm_tstate_insert(u32 key)
+{
+    struct sm_tstate *ts, *old;
+    unsigned int max = (cursor_mem_kb * 1024) / sizeof(*ts);
+    int i;
+    
+    ts = kmalloc(sizeof(*ts), GFP_ATOMIC | __GFP_NOWARN);
+    if (!ts)
+        return NULL;
+    ts->key = key;
+    ts->referenced = true;
+    for (i = 0; i < SM_FSM_MAX_AUTOMATA; i++)
+        atomic64_set(&ts->fsm_cursor[i], 0);
+    memset(ts->tat, 0, sizeof(ts->tat));
+    
+    spin_lock(&sm_tstate_lock);
+    hash_for_each_possible(sm_tstate_hash, old, node, key) {
+        if (old->key == key) {
+            spin_unlock(&sm_tstate_lock);
+            kfree(ts);
+            return old;
+        }
+    }
+    while (sm_tstate_count && sm_tstate_count >= max)
+        sm_tstate_evict_one();
+    hash_add_rcu(sm_tstate_hash, &ts->node, key);
+    list_add_tail(&ts->lru, &sm_tstate_lru);
+    sm_tstate_count++;
+    spin_unlock(&sm_tstate_lock);
+    
+    return ts;
+}
+
+static void sm_tstate_remove(u32 key)
+{
+    struct sm_tstate *ts;
+    
+    spin_lock(&sm_tstate_lock);
+    hash_for_each_possible(sm_tstate_hash, ts, node, key) {
+        if (ts->key == key) {
+            sm_tstate_free_rcu(ts);
+            break;
+        }
+    }
+    spin_unlock(&sm_tstate_lock);
+}
+
+static void sm_tstate_flush(void)
+{
+    struct sm_tstate *ts;
+    struct hlist_node *tmp;
+    int bkt;
+    
+    spin_lock(&sm_tstate_lock);
+    hash_for_each_safe(sm_tstate_hash, bkt, tmp, ts, node)
+        sm_tstate_free_rcu(ts);
+    spin_unlock(&sm_tstate_lock);
+}
+
+// Free cursors and follow entries of exiting tasks. Runs for every exit, so only take the
+// lock when there is something to remove.
+static void sm_probe_sched_exit(void *data, struct task_struct *p)
+{
+    struct sm_fsm *fsm;
+    u32 key = 0;
+    
+    if (static_branch_unlikely(&sm_key_follow))
+        sm_follow_remove(p->pid);
+    
+    rcu_read_lock();
+    fsm = rcu_dereference(active_fsm);
+    if (rcu_dereference(active_config)->mode == MODE_THROTTLE)    // buckets are per thread
+        key = p->pid;
+    else if (fsm && fsm->scope == SM_FSM_PER_PID)
+        key = p->pid;
+    else if (fsm && fsm->scope == SM_FSM_PER_TGID && !atomic_read(&p->signal->live))
+        key = p->tgid;
+    if (key && !sm_tstate_lookup(key))
+        key = 0;
+    rcu_read_unlock();
+    
+    if (key)
+        sm_tstate_remove(key);
+}
+
+// Runs in the parent before the child is first scheduled, so the child
+// is targeted from its very first syscall
+static void sm_probe_sched_fork(void *data, struct task_struct *parent, struct task_struct *child)
+{
+    if (!static_branch_unlikely(&sm_key_follow) || !static_branch_unlikely(&sm_key_targets))
+        return;
+    if (sm_target_match())
+        sm_follow_add(child->pid);
+}
+
+struct sm_tp_lookup {
+    const char *name;
+    struct tracepoint *tp;
+};
+
+static void sm_match_tracepoint(struct tracepoint *tp, void *priv)
+{
+    struct sm_tp_lookup *lookup = priv;
+    
+    if (!strcmp(tp->name, lookup->name))
+        lookup->tp = tp;
+}
+
+// Tracepoints are not exported symbols, find them by name
+static struct tracepoint *sm_lookup_tracepoint(const char *name)
+{
+    struct sm_tp_lookup lookup = { name, NULL };
+    
+    for_each_kernel_tracepoint(sm_match_tracepoint, &lookup);
+    return lookup.tp;
+}
+
+// Advance the cursor of one automaton, returning the transition taken or false
+static bool sm_fsm_advance(struct sm_fsm *fsm, int automaton, atomic64_t *cursor,
+                           int syscall_id, int *from, int *to)
+{
+    s64 old, new;
+    int cur, next;
+    
+    do {
+        old = atomic64_read(cursor);
+        cur = ((u64)old >> 32) == fsm->gen ? (u32)old : fsm->start[automaton];
+        next = fsm->next[cur][syscall_id];
+        if (next == SM_FSM_SET_NONE)
+            return false;
+        new = ((u64)fsm->gen << 32) | next;
+    } while (atomic64_cmpxchg(cursor, old, new) != old);
+    
+    *from = cur;
+    *to = next;
+    return true;
+}
+
+// Advance the FSM on a syscall. Only transitions produce events, so the
+// hot path for ignored syscalls is one table load per automaton.
+// Per-process cursors are created lazily, on the first syscall that
+// leaves a start state.
+static void sm_fsm_step(const struct sm_config *cfg, int syscall_id)
+{
+    unsigned long flags;
+    struct sm_ring *ring;
+    struct sm_event *ev;
+    struct sm_fsm *fsm;
+    struct sm_tstate *ts;
+    atomic64_t *cursors;
+    int i, cur, next;
+    u32 key;
+    
+    rcu_read_lock();
+    fsm = rcu_dereference(active_fsm);
+    if (!fsm)
+        goto out;
+    
+    if (fsm->scope == SM_FSM_GLOBAL) {
+        cursors = fsm->state;
+    } else {
+        key = fsm->scope == SM_FSM_PER_TGID ? current->tgid : current->pid;
+        ts = sm_tstate_lookup(key);
+        if (!ts) {
+            for (i = 0; i < fsm->num_automata; i++) {
+                if (fsm->next[fsm->start[i]][syscall_id] != SM_FSM_SET_NONE)
+                    break;
+            }
+            if (i == fsm->num_automata)
+                goto out;
+            ts = sm_tstate_insert(key);
+            if (!ts)
+                goto out;
+        }
+        cursors = ts->fsm_cursor;
+    }
+    
+    for (i = 0; i < fsm->num_automata; i++) {
+        if (!sm_fsm_advance(fsm, i, &cursors[i], syscall_id, &cur, &next))
+            continue;
+        
+        ring = this_cpu_ptr(&sm_rings);
+        local_irq_save(flags);
+        sm_coalesce_flush(ring);
+        ev = sm_event_reserve(ring, cfg->mode, sizeof(*ev), syscall_id,
+                              fsm->accept[next] ? OUTCOME_FSM_ACCEPT : OUTCOME_FSM_TRANSITION);
+        if (ev) {
+            ev->state_from = cur;
+            ev->state_to = next;
+            sm_event_commit(ring, sizeof(*ev));
+        }
+        local_irq_restore(flags);
+    }
+out:
+    rcu_read_unlock();
+}
+
+// Bump this CPU's log2 bucket for syscall id
+static void sm_latency_record(int id, u64 ns)
+{
+    this_cpu_inc(sm_lat.buckets[id][min_t(int, fls64(ns), SM_LAT_BUCKETS - 1)]);
+    this_cpu_add(sm_lat.total_ns[id], ns);
+}
+
+// Tracepoint backend: stamp the call for the matching sys_exit. A task
+// has at most one syscall in flight, so a slot holding another pid means
+// a hash collision and that call goes untimed.
+static void sm_latency_enter(int id)
+{
+    u32 pid = current->pid;
+    struct sm_inflight *slot = &sm_inflight[hash_32(pid, SM_INFLIGHT_BITS)];
+    u64 old = xchg(&slot->key, 0);
+    
+    if (old && old >> 32 != pid)
+        this_cpu_inc(sm_lat.missed);
+    WRITE_ONCE(slot->ts, ktime_get_ns());
+    smp_store_release(&slot->key, (u64)pid << 32 | id);
+}
+
+static void sm_latency_exit(int id)
+{
+    u32 pid = current->pid;
+    struct sm_inflight *slot = &sm_inflight[hash_32(pid, SM_INFLIGHT_BITS)];
+    u64 key = (u64)pid << 32 | id;
+    u64 ts;
+    
+    if (smp_load_acquire(&slot->key) != key)
+        return;
+    ts = READ_ONCE(slot->ts);
+    // claim the slot, fails if another task took it since the load
+    if (cmpxchg(&slot->key, key, 0) != key)
+        return;
+    sm_latency_record(id, ktime_get_ns() - ts);
+}
+
+// Charge the call to the bucket of the calling thread, over the limit it
+// is reported and, with SM_THROTTLE_DENY and a target set like BLOCK
+// mode, fails with -EAGAIN
+static int sm_throttle_step(const struct sm_config *cfg, int id, struct pt_regs *uregs)
+{
+    struct sm_throttle *thr;
+    struct sm_tstate *ts;
+    u64 now, tat;
+    int ret = 0;
+    
+    rcu_read_lock();
+    thr = rcu_dereference(active_throttle);
+    if (!thr || !thr->interval_ns[id])
+        goto out;
+    
+    ts = sm_tstate_lookup(current->pid);
+    if (!ts)
+        ts = sm_tstate_insert(current->pid);
+    if (!ts)
+        goto out;
+    
+    now = ktime_get_ns();
+    tat = max(ts->tat[id], now);
+    if (tat - now > thr->limit_ns[id]) {
+        sm_stat_inc(cfg, id, throttled);
+        sm_emit_event(cfg, id, OUTCOME_THROTTLED, uregs);
+        if (thr->deny && static_branch_unlikely(&sm_key_targets))
+            ret = -EAGAIN;
+        goto out;
+    }
+    ts->tat[id] = tat + thr->interval_ns[id];
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static u16 sm_trie_child(const struct sm_trie *trie, const struct sm_trie_node *tn, u8 ch)
+{
+    const struct sm_trie_edge *e = trie->edges + tn->edges;
+    int lo = 0, hi = tn->nr_edges;
+    
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        
+        if (e[mid].ch == ch)
+            return e[mid].node;
+        if (e[mid].ch < ch)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    return 0;
+}
+
+// Add a node, and the star runs that may start there, to an active set.
+// Returns true on reaching an accepting node, or when the set overflows:
+// a path too ambiguous to decide is reported rather than missed.
+static bool sm_trie_enter(const struct sm_trie *trie, u16 *set, int *n, u16 node)
+{
+    for (;;) {
+        int i;
+        
+        for (i = 0; i < *n; i++) {
+            if (set[i] == node)
+                return false;
+        }
+        if (*n == SM_TRIE_MAX_ACTIVE)
+            return true;
+        set[(*n)++] = node;
+        
+        if (trie->nodes[node].flags & SM_TRIE_ACCEPT)
+            return true;
+        if (!trie->nodes[node].star)
+            return false;
+        node = trie->nodes[node].star;
+    }
+}
+
+// Run the trie over path as an NFA, only wildcards make more than one
+// node active at a time
+static bool sm_trie_match(const struct sm_trie *trie, const char *path)
+{
+    u16 set[2][SM_TRIE_MAX_ACTIVE];
+    int n = 0, cur = 0, i;
+    
+    if (sm_trie_enter(trie, set[cur], &n, 0))
+        return true;
+    
+    for (; *path && n; path++) {
+        u8 ch = *path;
+        int m = 0;
+        
+        for (i = 0; i < n; i++) {
+            u16 node = set[cur][i];
+            const struct sm_trie_node *tn = &trie->nodes[node];
+            u16 child = sm_trie_child(trie, tn, ch);
+            
+            if (child && sm_trie_enter(trie, set[!cur], &m, child))
+                return true;
+            if (ch == '/')
+                continue;
+            if (tn->any && sm_trie_enter(trie, set[!cur], &m, tn->any))
+                return true;
+            if ((tn->flags & SM_TRIE_STAR) && sm_trie_enter(trie, set[!cur], &m, node))
+                return true;
+        }
+        cur = !cur;
+        n = m;
+    }
+    
+    return false;
+}
+
+// Copy the openat pathname into this CPU's scratch buffer and run the
+// filter on it. A path that cannot be read without faulting never matches.
+static bool sm_path_match(struct pt_regs *uregs)
+{
+    struct sm_ring *ring = this_cpu_ptr(&sm_rings);
+    struct sm_trie *trie;
+    unsigned long a[6];
+    bool match;
+    long len;
+    
+    syscall_get_arguments(current, uregs, a);
+    len = strncpy_from_user_nofault(ring->path_buf, (const char __user *)a[1], SM_PATH_MAX);
+    if (len <= 0)
+        return false;
+    ring->path_buf[SM_PATH_MAX - 1] = '\0';
+    
+    rcu_read_lock();
+    trie = rcu_dereference(active_paths);
+    match = !trie || sm_trie_match(trie, ring->path_buf);
+    rcu_read_unlock();
+    
+    return match;
+}
+
+// Check the calling task against a subscription's tgid and cgroup filter
+static bool sm_sub_match(const struct sm_sub *sub)
+{
+    struct cgroup *cgrp;
+    bool match = !sub->cgroup_id;
+    int i;
+    
+    if (sub->nr_tgids) {
+        for (i = 0; i < sub->nr_tgids && sub->tgids[i] != current->tgid; i++)
+            ;
+        if (i == sub->nr_tgids)
+            return false;
+    }
+    
+    if (!match) {
+        rcu_read_lock();
+        cgrp = task_dfl_cgroup(current);
+        for (i = cgrp->level; i >= 0 && !match; i--)
+            match = cgroup_id(cgroup_ancestor(cgrp, i)) == sub->cgroup_id;
+        rcu_read_unlock();
+    }
+    
+    return match;
+}
+
+// Copy the call to the rings of every subscriber that wants it. Each has
+// its own sampling and argument capture, drops count as LOG drops.
+static void sm_sub_dispatch(int id, struct pt_regs *uregs)
+{
+    struct sm_sub *sub;
+    
+    rcu_read_lock();
+    list_for_each_entry_rcu(sub, &sm_subs, node) {
+        if ((sub->cfg->syscall_mask & BIT(id)) && sm_sub_match(sub))
+            sm_emit_to(this_cpu_ptr(sub->stream.rings), sub->cfg, id, OUTCOME_LOGGED, uregs);
+    }
+    rcu_read_unlock();
+}
+
+// Common entry for both backends, runs with preemption disabled. Returns
+// the error a denied call must fail with, the backend applies it.
+static int sm_handle_syscall(int id, struct pt_regs *uregs)
+{
+    // both backends call in with preemption disabled, which config
+    // changes wait for, so one load sees one whole configuration
+    const struct sm_config *cfg = rcu_dereference_sched(active_config);
+    
+    // probes are armed for the union of the mode's and the subscribers'
+    // syscalls, a call nobody wants costs one bit test here
+    if (static_branch_unlikely(&sm_key_subs)) {
+        if (READ_ONCE(sm_sub_mask) & BIT(id))
+            sm_sub_dispatch(id, uregs);
+        if (!(READ_ONCE(sm_mode_mask) & BIT(id)))
+            return 0;
+    }
+    
+    if (static_branch_unlikely(&sm_key_targets) && !sm_target_match())
+        return 0;
+    
+    if (static_branch_unlikely(&sm_key_fsm)) {
+        sm_stat_inc(cfg, id, calls);
+        sm_fsm_step(cfg, id);
+        return 0;
+    }
+    
+    // the buckets name their own syscalls, like an FSM does
+    if (static_branch_unlikely(&sm_key_throttle)) {
+        sm_stat_inc(cfg, id, calls);
+        return sm_throttle_step(cfg, id, uregs);
+    }
+    
+    // accept and accept4 share an id, and the mask may be changing
+    if (!(cfg->syscall_mask & BIT(id)))
+        return 0;
+    if (id == SYSCALL_OPEN && static_branch_unlikely(&sm_key_paths) && !sm_path_match(uregs))
+        return 0;
+    sm_stat_inc(cfg, id, calls);
+    
+    // only reached through the tracepoint backend, kretprobes time kprobes
+    if (static_branch_unlikely(&sm_key_latency)) {
+        sm_latency_enter(id);
+        return 0;
+    }
+    
+    // denying openat machine-wide would take the system down, so without
+    // targets BLOCK mode only logs
+    if (static_branch_unlikely(&sm_key_block) && static_branch_unlikely(&sm_key_targets)) {
+        sm_stat_inc(cfg, id, blocked);
+        sm_emit_event(cfg, id, OUTCOME_BLOCKED, uregs);
+        return -EPERM;
+    }
+    
+    sm_emit_event(cfg, id, OUTCOME_LOGGED, uregs);
+    return 0;
+}
+
+// Return target for denied calls, a copy of the x86 error injection
+// just_return_func, which is not exported to modules
+asm(
+    ".text\n"
+    ".type sm_just_return_func, @function\n"
+    ASM_FUNC_ALIGN
+    "sm_just_return_func:\n"
+    ANNOTATE_NOENDBR
+    ASM_RET
+    ".size sm_just_return_func, .-sm_just_return_func\n"
+);
+void sm_just_return_func(void);
+
+// kprobe backend: shared pre-handler, the probe identifies the syscall.
+// The __x64_sys_* wrappers take the user registers as their argument and
+// are error-injectable, so a denied call can return its error straight
+// to the caller without running the body.
+static int handler_pre_syscall(struct kprobe *p, struct pt_regs *regs)
+{
+    struct pt_regs *uregs = (struct pt_regs *)regs_get_kernel_argument(regs, 0);
+    int err = sm_handle_syscall(container_of(p, struct sm_probe, kp)->syscall_id, uregs);
+    
+    if (!err)
+        return 0;
+    
+    regs_set_return_value(regs, err);
+    instruction_pointer_set(regs, (unsigned long)sm_just_return_func);
+    return 1;                       // ip changed, skip single-stepping
+}
+
+// kprobe backend, latency mode: the kretprobe entry handler stamps the
+// call, returning nonzero skips calls that are not targeted
+static int handler_entry_latency(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+    int id = container_of(get_kretprobe(ri), struct sm_probe, rp)->syscall_id;
+    const struct sm_config *cfg = rcu_dereference_sched(active_config);
+    
+    if (static_branch_unlikely(&sm_key_targets) && !sm_target_match())
+        return 1;
+    if (!(cfg->syscall_mask & BIT(id)))
+        return 1;
+    if (id == SYSCALL_OPEN && static_branch_unlikely(&sm_key_paths) &&
+        !sm_path_match((struct pt_regs *)regs_get_kernel_argument(regs, 0)))
+        return 1;
+    sm_stat_inc(cfg, id, calls);
+    
+    *(u64 *)ri->data = ktime_get_ns();
+    return 0;
+}
+
+static int handler_ret_latency(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+    int id = container_of(get_kretprobe(ri), struct sm_probe, rp)->syscall_id;
+    
+    sm_latency_record(id, ktime_get_ns() - *(u64 *)ri->data);
+    return 0;
+}
+
+// tracepoint backend: one hook on sys_enter covers every syscall. Since
+// 6.13 syscall tracepoints may fault and call probes preemptible, so the
+// armed check sits inside the preempt-disabled section that mode changes
+// wait for with synchronize_rcu().
+static void sm_probe_sys_enter(void *data, struct pt_regs *regs, long nr)
+{
+    int id, err = 0;
+    
+    // sm_nr_to_id holds x86_64 numbers, ia32 tasks reuse them for other
+    // syscalls. The kprobe backend only hooks __x64_sys_* and skips them too.
+    if ((unsigned long)nr >= SM_NR_SLOTS || syscall_get_arch(current) != AUDIT_ARCH_X86_64)
+        return;
+    id = sm_nr_to_id[nr];
+    if (id < 0)
+        return;
+    
+    preempt_disable_notrace();
+    if (READ_ONCE(sm_armed_mask) & BIT(id))
+        err = sm_handle_syscall(id, regs);
+    preempt_enable_notrace();
+    
+    // syscall number -1 makes the entry code skip the call and return ax
+    if (err) {
+        syscall_set_nr(current, regs, -1);
+        syscall_set_return_value(current, regs, err, 0);
+    }
+}
+
+// Only registered in latency mode, pairs with sm_latency_enter()
+static void sm_probe_sys_exit(void *data, struct pt_regs *regs, long ret)
+{
+    long nr = syscall_get_nr(current, regs);
+    int id;
+    
+    if ((unsigned long)nr >= SM_NR_SLOTS || syscall_get_arch(current) != AUDIT_ARCH_X86_64)
+        return;
+    id = sm_nr_to_id[nr];
+    if (id < 0)
+        return;
+    
+    preempt_disable_notrace();
+    if (READ_ONCE(sm_armed_mask) & BIT(id))
+        sm_latency_exit(id);
+    preempt_enable_notrace();
+}
+
+// Syscalls whose probes the current mode needs
+static u32 sm_wanted_mask(const struct sm_config *cfg)
+{
+    struct sm_throttle *thr;
+    struct sm_fsm *fsm;
+    u32 mask = 0;
+    
+    switch (cfg->mode) {
+        case MODE_LOG:
+        case MODE_BLOCK:
+        case MODE_LATENCY:
+            mask = cfg->syscall_mask;
+            break;
+            
+        case MODE_THROTTLE:
+            thr = rcu_dereference_protected(active_throttle, lockdep_is_held(&sm_config_lock));
+            if (thr)
+                mask = thr->syscall_mask;
+            break;
+            
+        case MODE_FSM:
+            rcu_read_lock();
+            fsm = rcu_dereference(active_fsm);
+            if (fsm)
+                mask = fsm->syscall_mask;
+            rcu_read_unlock();
+            break;
+    }
+    
+    return mask;
+}
+
+static void sm_kprobe_arm(struct kprobe *kp, bool registered, bool want)
+{
+    if (!registered || want == !kprobe_disabled(kp))
+        return;
+    if (want)
+        enable_kprobe(kp);
+    else
+        disable_kprobe(kp);
+}
+
+// Returns whether the probe is registered afterwards
+static bool sm_tracepoint_arm(struct tracepoint *tp, void *probe, bool registered, bool want)
+{
+    if (want == registered)
+        return registered;
+    if (want)
+        return !tracepoint_probe_register(tp, probe, NULL);
+    tracepoint_probe_unregister(tp, probe, NULL);
+    return false;
+}
+
+// Enable exactly the probes the current configuration needs
+static void sm_arm_probes(void)
+{
+    struct sm_config *cfg = rcu_dereference_protected(active_config,
+                                                      lockdep_is_held(&sm_config_lock));
+    u32 wanted = sm_wanted_mask(cfg);
+    bool latency = cfg->mode == MODE_LATENCY;
+    int i;
+    
+    if (sm_backend == SM_BACKEND_TRACEPOINT) {
+        WRITE_ONCE(sm_mode_mask, wanted);
+        WRITE_ONCE(sm_armed_mask, wanted | sm_sub_mask);
+        sm_sys_enter_registered = sm_tracepoint_arm(tp_sys_enter, sm_probe_sys_enter,
+                                                    sm_sys_enter_registered,
+                                                    wanted | sm_sub_mask);
+        sm_sys_exit_registered = sm_tracepoint_arm(tp_sys_exit, sm_probe_sys_exit,
+                                                   sm_sys_exit_registered, wanted && latency);
+        return;
+    }
+    
+    // kretprobes time the mode's calls here, kprobes only feed subscribers
+    WRITE_ONCE(sm_mode_mask, latency ? 0 : wanted);
+    for (i = 0; i < ARRAY_SIZE(sm_probes); i++) {
+        bool want = wanted & BIT(sm_probes[i].syscall_id);
+        bool sub = sm_sub_mask & BIT(sm_probes[i].syscall_id);
+        
+        sm_kprobe_arm(&sm_probes[i].kp, sm_probes[i].registered, (want && !latency) || sub);
+        sm_kprobe_arm(&sm_probes[i].rp.kp, sm_probes[i].rp_registered, want && latency);
+    }
+}
+
+// Entering latency mode starts a new measurement. Stale inflight slots
+// would pair with exits of unrelated calls, so they go as well.
+static void sm_latency_reset(void)
+{
+    int cpu, i;
+    
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&sm_lat, cpu), 0, sizeof(struct sm_latency));
+    for (i = 0; i < ARRAY_SIZE(sm_probes); i++)
+        sm_probes[i].rp.nmissed = 0;
+    memset(sm_inflight, 0, sizeof(sm_inflight));
+}
+
+// Sum the per-CPU histograms into one snapshot for userspace
+static int sm_latency_snapshot(struct sm_latency __user *ulat)
+{
+    struct sm_latency *sum;
+    int cpu, s, b, i, ret = 0;
+    
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+    
+    for_each_possible_cpu(cpu) {
+        struct sm_latency *lat = per_cpu_ptr(&sm_lat, cpu);
+        
+        for (s = 0; s < SM_NR_SYSCALLS; s++) {
+            for (b = 0; b < SM_LAT_BUCKETS; b++)
+                sum->buckets[s][b] += READ_ONCE(lat->buckets[s][b]);
+            sum->total_ns[s] += READ_ONCE(lat->total_ns[s]);
+        }
+        sum->missed += READ_ONCE(lat->missed);
+    }
+    // kretprobe instances run out when many calls block at once
+    for (i = 0; i < ARRAY_SIZE(sm_probes); i++)
+        sum->missed += READ_ONCE(sm_probes[i].rp.nmissed);
+    
+    if (copy_to_user(ulat, sum, sizeof(*sum)))
+        ret = -EFAULT;
+    kfree(sum);
+    return ret;
+}
+
+static void sm_stats_sum(struct sm_stats *sum)
+{
+    int cpu, m, s;
+    
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        struct sm_stats *stats = per_cpu_ptr(&sm_counters, cpu);
+        
+        for (m = 0; m < SM_NR_MODES; m++) {
+            for (s = 0; s < SM_NR_SYSCALLS; s++) {
+                sum->count[m][s].calls += READ_ONCE(stats->count[m][s].calls);
+                sum->count[m][s].blocked += READ_ONCE(stats->count[m][s].blocked);
+                sum->count[m][s].throttled += READ_ONCE(stats->count[m][s].throttled);
+                sum->count[m][s].dropped += READ_ONCE(stats->count[m][s].dropped);
+            }
+        }
+    }
+}
 
-static struct kprobe kp_open;
-static struct kprobe kp_read;
-static struct kprobe kp_write;
+// /proc/syscall_monitor: the summed counters, rows that never fired omitted
+static int sm_stats_show(struct seq_file *m, void *v)
+{
+    static const char * const mode_names[SM_NR_MODES] = {
+        "off", "log", "block", "fsm", "latency", "throttle"
+    };
+    static const char * const syscall_names[SM_NR_SYSCALLS] = {
+        "open", "read", "write", "close", "mmap", "connect", "accept", "execve"
+    };
+    struct sm_stats *sum;
+    int mode, s;
+    
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+    sm_stats_sum(sum);
+    
+    seq_printf(m, "%-8s %-8s %12s %12s %12s %12s\n", "mode", "syscall", "calls", "blocked",
+               "throttled", "dropped");
+    for (mode = 0; mode < SM_NR_MODES; mode++) {
+        for (s = 0; s < SM_NR_SYSCALLS; s++) {
+            struct sm_stat *st = &sum->count[mode][s];
+            
+            if (!st->calls && !st->dropped)
+                continue;
+            seq_printf(m, "%-8s %-8s %12llu %12llu %12llu %12llu\n", mode_names[mode],
+                       syscall_names[s], st->calls, st->blocked, st->throttled, st->dropped);
+        }
+    }
+    
+    kfree(sum);
+    return 0;
+}
 
-// IOCTL commands
-#define IOCTL_SET_MODE _IOW('s', 1, int)
-#define IOCTL_SET_SYSCALL _IOW('s', 2, int)
-#define IOCTL_SET_PID _IOW('s', 3, pid_t)
+static bool sm_config_samples(const struct sm_config *cfg)
+{
+    return cfg->sample_ratio > 1 || cfg->sample_interval_ns;
+}
 
-// open syscall
-static int handler_pre_open(struct kprobe *p, struct pt_regs *regs)
+// Sampling applies to LOG, BLOCK and THROTTLE events and to subscribers.
+// FSM transitions are rare by construction and always emitted.
+static void sm_sample_key_update(void)
 {
-    if (current_mode == MODE_OFF)
-        return 0;
+    struct sm_sub *sub;
+    bool on = sm_config_samples(rcu_dereference_protected(active_config,
+                                                          lockdep_is_held(&sm_config_lock)));
+    
+    list_for_each_entry(sub, &sm_subs, node)
+        on |= sm_config_samples(sub->cfg);
+    if (on)
+        static_branch_enable(&sm_key_sample);
+    else
+        static_branch_disable(&sm_key_sample);
+}
+
+// Publish cfg in place of the active configuration. A mode change, or a
+// restart of the mode, first disarms everything and waits for running
+// handlers, so no handler sees the keys of one mode with the
+// configuration of another.
+static void sm_config_publish(struct sm_config *cfg, bool restart)
+{
+    struct sm_config *old = rcu_dereference_protected(active_config,
+                                                      lockdep_is_held(&sm_config_lock));
+    int mode = cfg->mode, i;
     
-    if (current_mode == MODE_LOG && target_syscall == SYSCALL_OPEN) {
-        printk(KERN_INFO "SYSCALL_MONITOR: PID=%d called open()\n", current->pid);
+    if (mode == old->mode && !restart) {
+        rcu_assign_pointer(active_config, cfg);
+        goto arm;
     }
     
-    if (current_mode == MODE_BLOCK && target_syscall == SYSCALL_OPEN) {
-        if (target_pid == -1 || target_pid == current->pid) {
-            printk(KERN_INFO "SYSCALL_MONITOR: Blocking open() for PID=%d\n", current->pid);
-            return -1;
-        }
+    WRITE_ONCE(sm_armed_mask, 0);
+    for (i = 0; i < ARRAY_SIZE(sm_probes); i++) {
+        sm_kprobe_arm(&sm_probes[i].kp, sm_probes[i].registered, false);
+        sm_kprobe_arm(&sm_probes[i].rp.kp, sm_probes[i].rp_registered, false);
+    }
+    synchronize_rcu();
+    
+    rcu_assign_pointer(active_config, cfg);
+    if (mode == MODE_FSM)
+        static_branch_enable(&sm_key_fsm);
+    else
+        static_branch_disable(&sm_key_fsm);
+    if (mode == MODE_BLOCK)
+        static_branch_enable(&sm_key_block);
+    else
+        static_branch_disable(&sm_key_block);
+    if (mode == MODE_LATENCY) {
+        sm_latency_reset();
+        static_branch_enable(&sm_key_latency);
+    } else {
+        static_branch_disable(&sm_key_latency);
+    }
+    // start with full buckets, entries of an FSM may be keyed by tgid
+    if (mode == MODE_THROTTLE) {
+        sm_tstate_flush();
+        static_branch_enable(&sm_key_throttle);
+    } else {
+        static_branch_disable(&sm_key_throttle);
+    }
+    
+arm:
+    sm_sample_key_update();
+    sm_arm_probes();
+    
+    if (old != &sm_config_default)
+        kfree_rcu(old, rcu);
+}
+
+// The active configuration in request form, for changing single fields
+static void sm_config_export(struct sm_monitor_config *req)
+{
+    struct sm_config *cfg = rcu_dereference_protected(active_config,
+                                                      lockdep_is_held(&sm_config_lock));
+    
+    memset(req, 0, sizeof(*req));
+    req->version = SM_CONFIG_VERSION;
+    req->mode = cfg->mode;
+    req->syscall_mask = cfg->syscall_mask;
+    req->capture_mask = cfg->capture_mask;
+    req->sampling.ratio = cfg->sample_ratio;
+    req->sampling.max_rate = cfg->max_rate;
+    req->coalesce_usecs = cfg->coalesce_ns / NSEC_PER_USEC;
+}
+
+static struct sm_config *sm_config_build(const struct sm_monitor_config *req)
+{
+    struct sm_config *cfg;
+    
+    if (req->version != SM_CONFIG_VERSION || req->mode >= SM_NR_MODES ||
+        ((req->syscall_mask | req->capture_mask) & ~SM_SYSCALL_MASK_ALL) ||
+        (req->flags & ~SM_CONFIG_RESTART) || req->coalesce_usecs > USEC_PER_SEC)
+        return ERR_PTR(-EINVAL);
+    
+    cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+    if (!cfg)
+        return ERR_PTR(-ENOMEM);
+    cfg->mode = req->mode;
+    cfg->syscall_mask = req->syscall_mask;
+    cfg->capture_mask = req->capture_mask;
+    cfg->sample_ratio = max(req->sampling.ratio, 1U);
+    cfg->max_rate = req->sampling.max_rate;
+    if (cfg->max_rate) {
+        cfg->sample_interval_ns = max_t(u64, NSEC_PER_SEC / cfg->max_rate, 1);
+        // allow one second worth of events as a burst
+        cfg->sample_limit_ns = NSEC_PER_SEC - cfg->sample_interval_ns;
     }
+    cfg->coalesce_ns = (u64)req->coalesce_usecs * NSEC_PER_USEC;
+    
+    return cfg;
+}
+
+// Validate a request and publish it, caller holds sm_config_lock. With
+// restart, setting the current mode again starts it over: new latency
+// histograms, full throttle buckets.
+static int sm_config_apply(const struct sm_monitor_config *req, bool restart)
+{
+    struct sm_config *cfg;
+    
+    lockdep_assert_held(&sm_config_lock);
     
+    cfg = sm_config_build(req);
+    if (IS_ERR(cfg))
+        return PTR_ERR(cfg);
+    
+    sm_config_publish(cfg, restart);
     return 0;
 }
 
-// read syscall
-static int handler_pre_read(struct kprobe *p, struct pt_regs *regs)
+static int sm_config_set(const struct sm_monitor_config __user *ureq)
 {
-    if (current_mode == MODE_OFF)
-        return 0;
+    struct sm_monitor_config req;
+    int ret;
+    
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    
+    mutex_lock(&sm_config_lock);
+    ret = sm_config_apply(&req, req.flags & SM_CONFIG_RESTART);
+    mutex_unlock(&sm_config_lock);
+    if (ret)
+        return ret;
+    
+    printk(KERN_INFO "SYSCALL_MONITOR: Config applied: mode %u, syscalls 0x%x, capture 0x%x, "
+           "sampling 1 in %u, at most %u events/s per CPU, coalescing %u us\n", req.mode,
+           req.syscall_mask, req.capture_mask, max(req.sampling.ratio, 1U), req.sampling.max_rate,
+           req.coalesce_usecs);
+    return 0;
+}
+
+// Recompute the union of the subscribers' syscalls and re-arm for it
+static void sm_subs_update(void)
+{
+    struct sm_sub *sub;
+    u32 mask = 0;
+    
+    lockdep_assert_held(&sm_config_lock);
+    
+    list_for_each_entry(sub, &sm_subs, node)
+        mask |= sub->cfg->syscall_mask;
+    WRITE_ONCE(sm_sub_mask, mask);
+    if (list_empty(&sm_subs))
+        static_branch_disable(&sm_key_subs);
+    else
+        static_branch_enable(&sm_key_subs);
+    sm_sample_key_update();
+    sm_arm_probes();
+}
+
+// Give the file its own rings and filter, once, before it reads or maps
+static int sm_subscribe(struct file *file, const struct sm_subscription __user *ureq)
+{
+    struct sm_subscription req;
+    struct sm_sub *sub;
+    int i, ret;
+    
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    if (req.config.mode != MODE_LOG || req.nr_tgids > SM_SUB_MAX_TGIDS || req.reserved)
+        return -EINVAL;
+    for (i = 0; i < req.nr_tgids; i++) {
+        if (req.tgids[i] <= 0)
+            return -EINVAL;
+    }
+    
+    sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+    if (!sub)
+        return -ENOMEM;
+    sub->cfg = sm_config_build(&req.config);
+    if (IS_ERR(sub->cfg)) {
+        ret = PTR_ERR(sub->cfg);
+        kfree(sub);
+        return ret;
+    }
+    sub->cgroup_id = req.cgroup_id;
+    sub->nr_tgids = req.nr_tgids;
+    memcpy(sub->tgids, req.tgids, sizeof(sub->tgids));
+    init_waitqueue_head(&sub->stream.wait);
+    mutex_init(&sub->stream.read_lock);
+    sub->stream.rings = alloc_percpu(struct sm_ring);
+    ret = sub->stream.rings ? sm_rings_alloc(&sub->stream) : -ENOMEM;
+    if (ret)
+        goto fail;
     
-    if (current_mode == MODE_LOG && target_syscall == SYSCALL_READ) {
-        printk(KERN_INFO "SYSCALL_MONITOR: PID=%d called read()\n", current->pid);
+    mutex_lock(&sm_config_lock);
+    if (file->private_data) {
+        mutex_unlock(&sm_config_lock);
+        ret = -EBUSY;
+        goto fail;
     }
+    smp_store_release(&file->private_data, sub);
+    list_add_tail_rcu(&sub->node, &sm_subs);
+    sm_subs_update();
+    mutex_unlock(&sm_config_lock);
     
-    if (current_mode == MODE_BLOCK && target_syscall == SYSCALL_READ) {
-        if (target_pid == -1 || target_pid == current->pid) {
-            printk(KERN_INFO "SYSCALL_MONITOR: Blocking read() for PID=%d\n", current->pid);
+    printk(KERN_INFO "SYSCALL_MONITOR: Subscriber added, syscalls 0x%x\n", sub->cfg->syscall_mask);
+    return 0;
+    
+fail:
+    if (sub->stream.rings) {
+        sm_rings_free(&sub->stream);
+        free_percpu(sub->stream.rings);
+    }
+    kfree(sub->cfg);
+    kfree(sub);
+    return ret;
+}
+
+// The single-field ioctls change one field of a copy of the active config
+static int sm_set_mode(int mode)
+{
+    struct sm_monitor_config req;
+    int ret;
+    
+    mutex_lock(&sm_config_lock);
+    sm_config_export(&req);
+    req.mode = mode;
+    ret = sm_config_apply(&req, true);
+    mutex_unlock(&sm_config_lock);
+    return ret;
+}
+
+static int sm_set_syscall_mask(u32 mask)
+{
+    struct sm_monitor_config req;
+    int ret;
+    
+    mutex_lock(&sm_config_lock);
+    sm_config_export(&req);
+    req.syscall_mask = mask;
+    ret = sm_config_apply(&req, false);
+    mutex_unlock(&sm_config_lock);
+    return ret;
+}
+
+static int sm_set_capture_mask(u32 mask)
+{
+    struct sm_monitor_config req;
+    int ret;
+    
+    mutex_lock(&sm_config_lock);
+    sm_config_export(&req);
+    req.capture_mask = mask;
+    ret = sm_config_apply(&req, false);
+    mutex_unlock(&sm_config_lock);
+    return ret;
+}
+
+static int sm_sampling_set(const struct sm_sampling __user *usampling)
+{
+    struct sm_monitor_config req;
+    struct sm_sampling sampling;
+    int ret;
+    
+    if (copy_from_user(&sampling, usampling, sizeof(sampling)))
+        return -EFAULT;
+    
+    mutex_lock(&sm_config_lock);
+    sm_config_export(&req);
+    req.sampling = sampling;
+    ret = sm_config_apply(&req, false);
+    mutex_unlock(&sm_config_lock);
+    if (ret)
+        return ret;
+    
+    printk(KERN_INFO "SYSCALL_MONITOR: Sampling 1 in %u, at most %u events/s per CPU\n",
+           max(sampling.ratio, 1U), sampling.max_rate);
+    return 0;
+}
+
+// Build the trie in place with sibling lists kept sorted by character,
+// then lay each node's children out as its run of the edge array. A node
+// is never bigger than one pattern byte, so indexes fit in a u16.
+struct sm_trie_build {
+    u16 child;
+    u16 sibling;
+    u16 any;
+    u16 star;
+    u8 ch;
+    u8 flags;
+};
+
+static u16 sm_trie_build_child(struct sm_trie_build *b, u16 *nr, u16 node, u8 ch)
+{
+    u16 *link = &b[node].child;
+    
+    while (*link && b[*link].ch < ch)
+        link = &b[*link].sibling;
+    if (*link && b[*link].ch == ch)
+        return *link;
+    
+    b[*nr].ch = ch;
+    b[*nr].sibling = *link;
+    *link = *nr;
+    return (*nr)++;
+}
+
+static struct sm_trie *sm_trie_compile(const char *buf, size_t size)
+{
+    struct sm_trie_build *b;
+    struct sm_trie *trie = NULL;
+    u16 nr = 1, node = 0;
+    size_t i, nr_edges = 0;
+    
+    b = kvcalloc(size + 1, sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return NULL;
+    
+    for (i = 0; i < size; i++) {
+        u8 ch = buf[i];
+        
+        if (!ch) {
+            if (node)
+                b[node].flags |= SM_TRIE_ACCEPT;
+            node = 0;
+        } else if (ch == '*') {
+            if (b[node].flags & SM_TRIE_STAR)
+                continue;           // ** is the same as *
+            if (!b[node].star) {
+                b[nr].flags = SM_TRIE_STAR;
+                b[node].star = nr++;
+            }
+            node = b[node].star;
+        } else if (ch == '?') {
+            if (!b[node].any)
+                b[node].any = nr++;
+            node = b[node].any;
+        } else {
+            node = sm_trie_build_child(b, &nr, node, ch);
+            nr_edges++;
+        }
+    }
+    if (node)
+        b[node].flags |= SM_TRIE_ACCEPT;
+    
+    trie = kvmalloc(sizeof(*trie) + nr * sizeof(*trie->nodes) +
+                    nr_edges * sizeof(*trie->edges), GFP_KERNEL);
+    if (!trie)
+        goto out;
+    trie->nodes = (struct sm_trie_node *)(trie + 1);
+    trie->edges = (struct sm_trie_edge *)(trie->nodes + nr);
+    
+    nr_edges = 0;
+    for (node = 0; node < nr; node++) {
+        struct sm_trie_node *tn = &trie->nodes[node];
+        u16 c;
+        
+        tn->edges = nr_edges;
+        for (c = b[node].child; c; c = b[c].sibling) {
+            trie->edges[nr_edges].ch = b[c].ch;
+            trie->edges[nr_edges].node = c;
+            nr_edges++;
         }
+        tn->nr_edges = nr_edges - tn->edges;
+        tn->flags = b[node].flags;
+        tn->any = b[node].any;
+        tn->star = b[node].star;
+    }
+out:
+    kvfree(b);
+    return trie;
+}
+
+// Replace the openat path filter, an empty pattern buffer removes it
+static int sm_paths_set(const struct sm_path_filter __user *ufilter)
+{
+    struct sm_path_filter filter;
+    struct sm_trie *trie = NULL, *old;
+    char *buf;
+    
+    if (copy_from_user(&filter, ufilter, sizeof(filter)))
+        return -EFAULT;
+    if (filter.size > SM_PATHS_MAX_BYTES)
+        return -E2BIG;
+    
+    if (filter.size) {
+        buf = memdup_user(u64_to_user_ptr(filter.patterns), filter.size);
+        if (IS_ERR(buf))
+            return PTR_ERR(buf);
+        trie = sm_trie_compile(buf, filter.size);
+        kfree(buf);
+        if (!trie)
+            return -ENOMEM;
     }
     
+    mutex_lock(&sm_config_lock);
+    old = rcu_replace_pointer(active_paths, trie, lockdep_is_held(&sm_config_lock));
+    if (trie)
+        static_branch_enable(&sm_key_paths);
+    else
+        static_branch_disable(&sm_key_paths);
+    mutex_unlock(&sm_config_lock);
+    if (old)
+        kvfree_rcu(old, rcu);
+    
+    printk(KERN_INFO "SYSCALL_MONITOR: openat path filter %s\n", trie ? "set" : "removed");
     return 0;
 }
 
-// write syscall
-static int handler_pre_write(struct kprobe *p, struct pt_regs *regs)
+// Replace the throttle buckets, rates apply to calls from then on
+static int sm_throttle_set(const struct sm_throttle_config __user *ucfg)
 {
-    if (current_mode == MODE_OFF)
-        return 0;
+    struct sm_throttle_config cfg;
+    struct sm_throttle *thr, *old;
+    int i;
+    
+    if (copy_from_user(&cfg, ucfg, sizeof(cfg)))
+        return -EFAULT;
+    if (cfg.flags & ~SM_THROTTLE_DENY)
+        return -EINVAL;
+    
+    thr = kzalloc(sizeof(*thr), GFP_KERNEL);
+    if (!thr)
+        return -ENOMEM;
+    
+    for (i = 0; i < SM_NR_SYSCALLS; i++) {
+        if (!cfg.rate[i])
+            continue;
+        thr->interval_ns[i] = max_t(u64, NSEC_PER_SEC / cfg.rate[i], 1);
+        thr->limit_ns[i] = (u64)(max(cfg.burst[i], 1U) - 1) * thr->interval_ns[i];
+        thr->syscall_mask |= BIT(i);
+    }
+    thr->deny = cfg.flags & SM_THROTTLE_DENY;
+    
+    mutex_lock(&sm_config_lock);
+    old = rcu_replace_pointer(active_throttle, thr, lockdep_is_held(&sm_config_lock));
+    sm_arm_probes();
+    printk(KERN_INFO "SYSCALL_MONITOR: Throttle set for syscall mask 0x%x%s\n",
+           thr->syscall_mask, thr->deny ? ", denying with EAGAIN" : "");
+    mutex_unlock(&sm_config_lock);
+    if (old)
+        kfree_rcu(old, rcu);
+    
+    return 0;
+}
+
+// Tables follow the struct, accept first to keep it aligned
+static struct sm_fsm *sm_fsm_alloc(u32 num_states)
+{
+    struct sm_fsm *fsm;
+    
+    fsm = kvzalloc(sizeof(*fsm) + num_states * (sizeof(*fsm->accept) + sizeof(*fsm->next)),
+                   GFP_KERNEL);
+    if (!fsm)
+        return NULL;
+    fsm->num_states = num_states;
+    fsm->accept = (u64 *)(fsm + 1);
+    fsm->next = (void *)(fsm->accept + num_states);
+    return fsm;
+}
+
+// Check start states and targets, and collect the syscalls in use
+static int sm_fsm_validate(struct sm_fsm *fsm)
+{
+    int s, i;
+    
+    if (fsm->num_automata == 0 || fsm->num_automata > SM_FSM_MAX_AUTOMATA ||
+        fsm->scope > SM_FSM_PER_PID)
+        return -EINVAL;
+    for (i = 0; i < fsm->num_automata; i++) {
+        if (fsm->start[i] >= fsm->num_states)
+            return -EINVAL;
+    }
+    for (s = 0; s < fsm->num_states; s++) {
+        for (i = 0; i < SM_NR_SYSCALLS; i++) {
+            u16 next = fsm->next[s][i];
+            if (next == SM_FSM_SET_NONE)
+                continue;
+            if (next >= fsm->num_states)
+                return -EINVAL;
+            fsm->syscall_mask |= BIT(i);
+        }
+    }
+    return 0;
+}
+
+// Replace the active FSM, NULL removes it
+static void sm_fsm_install(struct sm_fsm *fsm)
+{
+    struct sm_fsm *old;
+    int i;
     
-    if (current_mode == MODE_LOG && target_syscall == SYSCALL_WRITE) {
-        printk(KERN_INFO "SYSCALL_MONITOR: PID=%d called write()\n", current->pid);
+    mutex_lock(&sm_fsm_lock);
+    if (fsm) {
+        fsm->gen = ++fsm_gen;
+        for (i = 0; i < fsm->num_automata; i++)
+            atomic64_set(&fsm->state[i], ((u64)fsm->gen << 32) | fsm->start[i]);
     }
+    old = rcu_replace_pointer(active_fsm, fsm, lockdep_is_held(&sm_fsm_lock));
+    sm_tstate_flush();
+    mutex_unlock(&sm_fsm_lock);
+    if (old)
+        kvfree_rcu(old, rcu);
+    
+    mutex_lock(&sm_config_lock);
+    sm_arm_probes();
+    mutex_unlock(&sm_config_lock);
+    
+    printk(KERN_INFO "SYSCALL_MONITOR: FSM loaded with %u states in %u automata\n",
+           fsm ? fsm->num_states : 0, fsm ? fsm->num_automata : 0);
+}
+
+// Replace the active FSM with one table run as a single automaton, a
+// table with no states removes it
+static int sm_fsm_upload(const struct sm_fsm_table __user *utable)
+{
+    struct sm_fsm_table *table;
+    struct sm_fsm *fsm = NULL;
+    int s, i, ret = 0;
+    
+    table = memdup_user(utable, sizeof(*table));
+    if (IS_ERR(table))
+        return PTR_ERR(table);
     
-    if (current_mode == MODE_BLOCK && target_syscall == SYSCALL_WRITE) {
-        if (target_pid == -1 || target_pid == current->pid) {
-            printk(KERN_INFO "SYSCALL_MONITOR: Blocking write() for PID=%d\n", current->pid);
+    if (table->num_states) {
+        ret = -EINVAL;
+        if (table->num_states > SM_FSM_MAX_STATES)
+            goto out;
+        ret = -ENOMEM;
+        fsm = sm_fsm_alloc(table->num_states);
+        if (!fsm)
+            goto out;
+        fsm->num_automata = 1;
+        fsm->scope = table->scope;
+        fsm->start[0] = table->start_state;
+        for (s = 0; s < table->num_states; s++) {
+            fsm->accept[s] = (table->accept_mask >> s) & 1;
+            for (i = 0; i < SM_NR_SYSCALLS; i++) {
+                u8 next = table->next[s][i];
+                fsm->next[s][i] = next == SM_FSM_NONE ? SM_FSM_SET_NONE : next;
+            }
+        }
+        ret = sm_fsm_validate(fsm);
+        if (ret) {
+            kvfree(fsm);
+            goto out;
         }
     }
+    sm_fsm_install(fsm);
+out:
+    kfree(table);
+    return ret;
+}
+
+// Replace the active FSM with a set of automata, no states removes it
+static int sm_fsm_set_upload(const struct sm_fsm_set __user *uset)
+{
+    struct sm_fsm_set set;
+    struct sm_fsm *fsm = NULL;
+    int ret;
     
+    if (copy_from_user(&set, uset, sizeof(set)))
+        return -EFAULT;
+    
+    if (set.num_states) {
+        if (set.num_states > SM_FSM_SET_MAX_STATES)
+            return -EINVAL;
+        fsm = sm_fsm_alloc(set.num_states);
+        if (!fsm)
+            return -ENOMEM;
+        fsm->num_automata = set.num_automata;
+        fsm->scope = set.scope;
+        memcpy(fsm->start, set.start, sizeof(fsm->start));
+        if (copy_from_user(fsm->next, u64_to_user_ptr(set.next),
+                           set.num_states * sizeof(*fsm->next)) ||
+            copy_from_user(fsm->accept, u64_to_user_ptr(set.accept),
+                           set.num_states * sizeof(*fsm->accept))) {
+            kvfree(fsm);
+            return -EFAULT;
+        }
+        ret = sm_fsm_validate(fsm);
+        if (ret) {
+            kvfree(fsm);
+            return ret;
+        }
+    }
+    sm_fsm_install(fsm);
     return 0;
 }
 
 // ioctl handler
 static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-    int value;
+    int value, ret = 0;
+    u32 mask;
+    pid_t pid;
+    struct sm_idset *set;
+    struct sm_ring_info info;
+    struct sm_wakeup wakeup;
+    struct sm_stats *stats;
+    struct sm_cgroup_target cgroup;
+    struct sm_monitor_config config;
+    u32 follow;
     
     switch(cmd) {
         case IOCTL_SET_MODE:
             if (copy_from_user(&value, (int __user *)arg, sizeof(int)))
                 return -EFAULT;
-            if (value >= MODE_OFF && value <= MODE_BLOCK) {
-                current_mode = value;
+            if (value >= MODE_OFF && value < SM_NR_MODES) {
+                ret = sm_set_mode(value);
+                if (ret)
+                    return ret;
                 printk(KERN_INFO "SYSCALL_MONITOR: Mode changed to %d\n", value);
+                if (value == MODE_BLOCK && !static_key_enabled(&sm_key_targets))
+                    printk(KERN_INFO "SYSCALL_MONITOR: No targets, BLOCK mode only logs\n");
             }
             break;
             
         case IOCTL_SET_SYSCALL:
             if (copy_from_user(&value, (int __user *)arg, sizeof(int)))
                 return -EFAULT;
-            if (value >= SYSCALL_OPEN && value <= SYSCALL_WRITE) {
-                target_syscall = value;
+            if (value >= 0 && value < SM_NR_SYSCALLS) {
+                ret = sm_set_syscall_mask(BIT(value));
+                if (ret)
+                    return ret;
                 printk(KERN_INFO "SYSCALL_MONITOR: Target syscall changed to %d\n", value);
             }
             break;
             
+        case IOCTL_SET_SYSCALL_MASK:
+            if (copy_from_user(&mask, (__u32 __user *)arg, sizeof(mask)))
+                return -EFAULT;
+            ret = sm_set_syscall_mask(mask);
+            if (ret)
+                return ret;
+            printk(KERN_INFO "SYSCALL_MONITOR: Target syscall mask changed to 0x%x\n", mask);
+            break;
+            
+        // replaces all targets with a single pid, -1 targets every process
         case IOCTL_SET_PID:
-            if (copy_from_user(&target_pid, (pid_t __user *)arg, sizeof(pid_t)))
+            if (copy_from_user(&pid, (pid_t __user *)arg, sizeof(pid_t)))
+                return -EFAULT;
+            if (pid == 0 || pid < -1)
+                return -EINVAL;
+            // Replaces targets of every kind, -1 leaves none
+            set = pid == -1 ? NULL : sm_idset_update(NULL, pid, true);
+            if (IS_ERR(set))
+                return PTR_ERR(set);
+            sm_target_replace(set);
+            printk(KERN_INFO "SYSCALL_MONITOR: Target PID changed to %d\n", pid);
+            return 0;
+            
+        case IOCTL_ADD_PID:
+        case IOCTL_DEL_PID:
+            if (copy_from_user(&pid, (pid_t __user *)arg, sizeof(pid_t)))
                 return -EFAULT;
-            printk(KERN_INFO "SYSCALL_MONITOR: Target PID changed to %d\n", target_pid);
+            if (pid <= 0)
+                return -EINVAL;
+            return sm_target_update(&target_pids, pid, cmd == IOCTL_ADD_PID);
+            
+        case IOCTL_ADD_TGID:
+        case IOCTL_DEL_TGID:
+            if (copy_from_user(&pid, (pid_t __user *)arg, sizeof(pid_t)))
+                return -EFAULT;
+            if (pid <= 0)
+                return -EINVAL;
+            return sm_target_update(&target_tgids, pid, cmd == IOCTL_ADD_TGID);
+            
+        case IOCTL_ADD_CGROUP:
+        case IOCTL_DEL_CGROUP:
+            if (copy_from_user(&cgroup, (struct sm_cgroup_target __user *)arg, sizeof(cgroup)))
+                return -EFAULT;
+            if (cgroup.flags & ~SM_CGROUP_DESCENDANTS)
+                return -EINVAL;
+            return sm_target_update((cgroup.flags & SM_CGROUP_DESCENDANTS) ?
+                                    &target_cgroup_trees : &target_cgroups,
+                                    cgroup.id, cmd == IOCTL_ADD_CGROUP);
+            
+        case IOCTL_SET_FOLLOW:
+            if (copy_from_user(&follow, (__u32 __user *)arg, sizeof(follow)))
+                return -EFAULT;
+            if (follow && !tp_sched_fork)
+                return -EOPNOTSUPP;
+            sm_follow_set(follow);
+            printk(KERN_INFO "SYSCALL_MONITOR: Following children %s\n", follow ? "on" : "off");
+            break;
+            
+        case IOCTL_CLEAR_TARGETS:
+            sm_target_clear();
+            printk(KERN_INFO "SYSCALL_MONITOR: Targets cleared\n");
+            break;
+        
+        case IOCTL_GET_RING_INFO:
+            info.nr_cpus = nr_cpu_ids;
+            info.mmap_size = SM_RING_MMAP_SIZE;
+            info.data_size = SM_RING_DATA_SIZE;
+            info.record_size = sizeof(struct sm_event);
+            if (copy_to_user((struct sm_ring_info __user *)arg, &info, sizeof(info)))
+                return -EFAULT;
+            break;
+            
+        case IOCTL_SET_FSM:
+            return sm_fsm_upload((const struct sm_fsm_table __user *)arg);
+            
+        case IOCTL_SET_FSM_SET:
+            return sm_fsm_set_upload((const struct sm_fsm_set __user *)arg);
+            
+        case IOCTL_GET_LATENCY:
+            return sm_latency_snapshot((struct sm_latency __user *)arg);
+            
+        case IOCTL_SET_PATHS:
+            return sm_paths_set((const struct sm_path_filter __user *)arg);
+            
+        case IOCTL_SET_CAPTURE:
+            if (copy_from_user(&mask, (__u32 __user *)arg, sizeof(mask)))
+                return -EFAULT;
+            ret = sm_set_capture_mask(mask);
+            if (ret)
+                return ret;
+            printk(KERN_INFO "SYSCALL_MONITOR: Argument capture mask changed to 0x%x\n", mask);
+            break;
+            
+        case IOCTL_SET_CONFIG:
+            return sm_config_set((const struct sm_monitor_config __user *)arg);
+            
+        case IOCTL_SUBSCRIBE:
+            return sm_subscribe(file, (const struct sm_subscription __user *)arg);
+            
+        case IOCTL_GET_CONFIG:
+            mutex_lock(&sm_config_lock);
+            sm_config_export(&config);
+            mutex_unlock(&sm_config_lock);
+            if (copy_to_user((struct sm_monitor_config __user *)arg, &config, sizeof(config)))
+                return -EFAULT;
+            break;
+            
+        case IOCTL_SET_SAMPLING:
+            return sm_sampling_set((const struct sm_sampling __user *)arg);
+            
+        case IOCTL_SET_THROTTLE:
+            return sm_throttle_set((const struct sm_throttle_config __user *)arg);
+            
+        case IOCTL_GET_STATS:
+            stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+            if (!stats)
+                return -ENOMEM;
+            sm_stats_sum(stats);
+            ret = copy_to_user((struct sm_stats __user *)arg, stats, sizeof(*stats)) ? -EFAULT : 0;
+            kfree(stats);
+            return ret;
+            
+        case IOCTL_SET_WAKEUP:
+            if (copy_from_user(&wakeup, (struct sm_wakeup __user *)arg, sizeof(wakeup)))
+                return -EFAULT;
+            if (wakeup.events == 0)
+                return -EINVAL;
+            WRITE_ONCE(wake_events, wakeup.events);
+            WRITE_ONCE(wake_usecs, wakeup.usecs);
+            printk(KERN_INFO "SYSCALL_MONITOR: Wakeup after %u events or %u us\n",
+                   wakeup.events, wakeup.usecs);
             break;
             
         default:
@@ -133,26 +2768,226 @@ static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
     return 0;
 }
 
+static int sm_copy_run(struct sm_ring *ring, char __user *buf, u64 start, u64 end)
+{
+    if (start == end)
+        return 0;
+    if (copy_to_user(buf, ring->data + (start & (SM_RING_DATA_SIZE - 1)), end - start))
+        return -EFAULT;
+    return 0;
+}
+
+// Copy the whole records of one ring, batching contiguous runs into one
+// copy_to_user() and skipping fillers. Returns 1 once the next record
+// does not fit in the buffer.
+static int sm_ring_read(struct sm_ring *ring, char __user *buf, size_t count, size_t *copied)
+{
+    struct sm_ring_header *hdr = ring->hdr;
+    u64 head = smp_load_acquire(&hdr->head);
+    u64 tail = READ_ONCE(hdr->tail);
+    u64 start;
+    bool bad = false;
+    int ret = 0;
+    
+    // resync if a mmap consumer left tail somewhere impossible
+    if (head - tail > SM_RING_DATA_SIZE)
+        tail = head;
+    start = tail;
+    
+    while (tail != head) {
+        size_t off = tail & (SM_RING_DATA_SIZE - 1);
+        const struct sm_event *ev = (const struct sm_event *)(ring->data + off);
+        size_t size = READ_ONCE(ev->size);
+        
+        // the data pages are writable through the mapping as well
+        if (size < sizeof(*ev) || size % sizeof(*ev) || off + size > SM_RING_DATA_SIZE ||
+            size > head - tail) {
+            bad = true;
+            break;
+        }
+        
+        if (READ_ONCE(ev->flags) & SM_EVENT_PAD) {
+            if (sm_copy_run(ring, buf + *copied, start, tail))
+                goto fault;
+            *copied += tail - start;
+            tail += size;
+            start = tail;
+            continue;
+        }
+        
+        if (*copied + (tail - start) + size > count) {
+            ret = 1;
+            break;
+        }
+        tail += size;
+        
+        // a run ending exactly at the ring end continues at offset 0
+        if (!(tail & (SM_RING_DATA_SIZE - 1))) {
+            if (sm_copy_run(ring, buf + *copied, start, tail))
+                goto fault;
+            *copied += tail - start;
+            start = tail;
+        }
+    }
+    
+    if (sm_copy_run(ring, buf + *copied, start, tail))
+        goto fault;
+    *copied += tail - start;
+    
+    // a bad record makes the rest of the ring unreadable, skip it all
+    if (bad)
+        tail = head;
+    smp_store_release(&hdr->tail, tail);
+    return ret;
+fault:
+    smp_store_release(&hdr->tail, start);
+    return -EFAULT;
+}
+
+// The rings a file reads: its subscription's, or the device's own
+static struct sm_stream *sm_file_stream(struct file *file)
+{
+    struct sm_sub *sub = smp_load_acquire(&file->private_data);
+    
+    return sub ? &sub->stream : &sm_stream;
+}
+
+// Copy whole records out of the rings, sleeping until at least one exists
+static ssize_t device_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct sm_stream *st = sm_file_stream(file);
+    size_t copied = 0;
+    int cpu, ret = 0;
+    
+    if (count < sizeof(struct sm_event))
+        return -EINVAL;
+    
+retry:
+    for (;;) {
+        if (mutex_lock_interruptible(&st->read_lock))
+            return -ERESTARTSYS;
+        if (sm_events_available(st))
+            break;
+        mutex_unlock(&st->read_lock);
+        
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(st->wait, sm_events_available(st));
+        if (ret)
+            return ret;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        ret = sm_ring_read(per_cpu_ptr(st->rings, cpu), buf, count, &copied);
+        if (ret)
+            break;
+    }
+    
+    mutex_unlock(&st->read_lock);
+    if (copied)
+        return copied;
+    if (ret > 0)                    // next record larger than the buffer
+        return -EINVAL;
+    if (ret < 0)
+        return ret;
+    goto retry;                     // only fillers were pending
+}
+
+static __poll_t device_poll(struct file *file, poll_table *wait)
+{
+    struct sm_stream *st = sm_file_stream(file);
+    
+    poll_wait(file, &st->wait, wait);
+    
+    return sm_events_available(st) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+// Map the ring of one CPU: offset cpu * SM_RING_MMAP_SIZE
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long ring_pages = SM_RING_MMAP_SIZE >> PAGE_SHIFT;
+    unsigned long cpu = vma->vm_pgoff / ring_pages;
+    unsigned long pgoff = vma->vm_pgoff % ring_pages;
+    
+    if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+        return -EINVAL;
+    
+    return remap_vmalloc_range(vma, per_cpu_ptr(sm_file_stream(file)->rings, cpu)->base, pgoff);
+}
+
+// Last close of a subscribed file: mappings hold the file, so nothing
+// maps the rings any more, and after a grace period nothing fills them
+static int device_release(struct inode *inode, struct file *file)
+{
+    struct sm_sub *sub = file->private_data;
+    
+    if (!sub)
+        return 0;
+    
+    mutex_lock(&sm_config_lock);
+    list_del_rcu(&sub->node);
+    sm_subs_update();
+    mutex_unlock(&sm_config_lock);
+    synchronize_rcu();
+    
+    sm_rings_free(&sub->stream);
+    free_percpu(sub->stream.rings);
+    kfree(sub->cfg);
+    kfree(sub);
+    printk(KERN_INFO "SYSCALL_MONITOR: Subscriber removed\n");
+    return 0;
+}
+
 static struct file_operations fops = {
+    .owner = THIS_MODULE,           // subscribers keep the module loaded
+    .read = device_read,
+    .poll = device_poll,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
+    .release = device_release,
 };
 
 // Module initialization
 static int __init syscall_monitor_init(void)
 {
-    int ret;
+    int ret, i;
     
     printk(KERN_INFO "SYSCALL_MONITOR: Initializing module\n");
     
+    if (!strcmp(backend, "tracepoint")) {
+        sm_backend = SM_BACKEND_TRACEPOINT;
+        tp_sys_enter = sm_lookup_tracepoint("sys_enter");
+        tp_sys_exit = sm_lookup_tracepoint("sys_exit");
+        if (!tp_sys_enter || !tp_sys_exit) {
+            printk(KERN_ALERT "SYSCALL_MONITOR: sys_enter/sys_exit tracepoints not found\n");
+            return -ENOENT;
+        }
+        memset(sm_nr_to_id, -1, sizeof(sm_nr_to_id));
+        for (i = 0; i < ARRAY_SIZE(sm_probes); i++)
+            sm_nr_to_id[sm_probes[i].nr] = sm_probes[i].syscall_id;
+    } else if (strcmp(backend, "kprobe")) {
+        printk(KERN_ALERT "SYSCALL_MONITOR: Unknown backend %s\n", backend);
+        return -EINVAL;
+    }
+    
+    ret = sm_rings_alloc(&sm_stream);
+    if (ret < 0) {
+        printk(KERN_ALERT "SYSCALL_MONITOR: Failed to allocate event rings\n");
+        sm_rings_free(&sm_stream);
+        return ret;
+    }
+    
     major_number = register_chrdev(0, DEVICE_NAME, &fops);
     if (major_number < 0) {
         printk(KERN_ALERT "SYSCALL_MONITOR: Failed to register device\n");
+        sm_rings_free(&sm_stream);
         return major_number;
     }
     
     syscall_class = class_create( CLASS_NAME);
     if (IS_ERR(syscall_class)) {
         unregister_chrdev(major_number, DEVICE_NAME);
+        sm_rings_free(&sm_stream);
         return PTR_ERR(syscall_class);
     }
     
@@ -160,40 +2995,57 @@ static int __init syscall_monitor_init(void)
     if (IS_ERR(syscall_device)) {
         class_destroy(syscall_class);
         unregister_chrdev(major_number, DEVICE_NAME);
+        sm_rings_free(&sm_stream);
         return PTR_ERR(syscall_device);
     }
     
-    // open
-    kp_open.symbol_name = "__x64_sys_openat";
-    kp_open.pre_handler = handler_pre_open;
-    ret = register_kprobe(&kp_open);
-    if (ret < 0) {
-        printk(KERN_INFO "SYSCALL_MONITOR: Trying alternative open symbol\n");
-        kp_open.symbol_name = "__x64_sys_openat";
-        ret = register_kprobe(&kp_open);
+    for (i = 0; sm_backend == SM_BACKEND_KPROBE && i < ARRAY_SIZE(sm_probes); i++) {
+        sm_probes[i].kp.symbol_name = sm_probes[i].symbol;
+        sm_probes[i].kp.pre_handler = handler_pre_syscall;
+        sm_probes[i].kp.flags = KPROBE_FLAG_DISABLED;   // armed by mode changes
+        ret = register_kprobe(&sm_probes[i].kp);
         if (ret < 0) {
-            printk(KERN_ERR "SYSCALL_MONITOR: Failed to register kprobe for open\n");
+            printk(KERN_ERR "SYSCALL_MONITOR: Failed to register kprobe for %s\n",
+                   sm_probes[i].symbol);
+            continue;
         }
+        sm_probes[i].registered = true;
+        
+        // blocking calls hold an instance until they return
+        sm_probes[i].rp.kp.symbol_name = sm_probes[i].symbol;
+        sm_probes[i].rp.kp.flags = KPROBE_FLAG_DISABLED;
+        sm_probes[i].rp.entry_handler = handler_entry_latency;
+        sm_probes[i].rp.handler = handler_ret_latency;
+        sm_probes[i].rp.data_size = sizeof(u64);
+        sm_probes[i].rp.maxactive = max_t(int, 64, 4 * num_possible_cpus());
+        if (register_kretprobe(&sm_probes[i].rp) < 0) {
+            printk(KERN_ERR "SYSCALL_MONITOR: Failed to register kretprobe for %s\n",
+                   sm_probes[i].symbol);
+            continue;
+        }
+        sm_probes[i].rp_registered = true;
     }
     
-    // read
-    kp_read.symbol_name = "__x64_sys_read";
-    kp_read.pre_handler = handler_pre_read;
-    ret = register_kprobe(&kp_read);
-    if (ret < 0) {
-        printk(KERN_ERR "SYSCALL_MONITOR: Failed to register kprobe for read\n");
+    // task exit, frees per-process FSM cursors
+    tp_sched_exit = sm_lookup_tracepoint("sched_process_exit");
+    if (!tp_sched_exit || tracepoint_probe_register(tp_sched_exit, sm_probe_sched_exit, NULL)) {
+        printk(KERN_ERR "SYSCALL_MONITOR: Failed to hook sched_process_exit\n");
+        tp_sched_exit = NULL;
     }
     
-    // write
-    kp_write.symbol_name = "__x64_sys_write";
-    kp_write.pre_handler = handler_pre_write;
-    ret = register_kprobe(&kp_write);
-    if (ret < 0) {
-        printk(KERN_ERR "SYSCALL_MONITOR: Failed to register kprobe for write\n");
+    // task fork, for following the children of targets
+    tp_sched_fork = sm_lookup_tracepoint("sched_process_fork");
+    if (!tp_sched_fork || tracepoint_probe_register(tp_sched_fork, sm_probe_sched_fork, NULL)) {
+        printk(KERN_ERR "SYSCALL_MONITOR: Failed to hook sched_process_fork\n");
+        tp_sched_fork = NULL;
     }
     
+    sm_proc = proc_create_single(DEVICE_NAME, 0444, NULL, sm_stats_show);
+    if (!sm_proc)
+        printk(KERN_ERR "SYSCALL_MONITOR: Failed to create /proc/%s\n", DEVICE_NAME);
+    
     printk(KERN_INFO "SYSCALL_MONITOR: Device created: /dev/%s\n", DEVICE_NAME);
-    printk(KERN_INFO "SYSCALL_MONITOR: Module loaded successfully\n");
+    printk(KERN_INFO "SYSCALL_MONITOR: Module loaded successfully (%s backend)\n", backend);
     
     return 0;
 }
@@ -201,14 +3053,41 @@ static int __init syscall_monitor_init(void)
 // Module cleanup
 static void __exit syscall_monitor_exit(void)
 {
-    unregister_kprobe(&kp_open);
-    unregister_kprobe(&kp_read);
-    unregister_kprobe(&kp_write);
+    int i;
     
+    for (i = 0; i < ARRAY_SIZE(sm_probes); i++) {
+        if (sm_probes[i].registered)
+            unregister_kprobe(&sm_probes[i].kp);
+        if (sm_probes[i].rp_registered)
+            unregister_kretprobe(&sm_probes[i].rp);
+    }
+    if (sm_sys_enter_registered)
+        tracepoint_probe_unregister(tp_sys_enter, sm_probe_sys_enter, NULL);
+    if (sm_sys_exit_registered)
+        tracepoint_probe_unregister(tp_sys_exit, sm_probe_sys_exit, NULL);
+    if (tp_sched_exit)
+        tracepoint_probe_unregister(tp_sched_exit, sm_probe_sched_exit, NULL);
+    if (tp_sched_fork)
+        tracepoint_probe_unregister(tp_sched_fork, sm_probe_sched_fork, NULL);
+    tracepoint_synchronize_unregister();
+    
+    proc_remove(sm_proc);
     device_destroy(syscall_class, MKDEV(major_number, 0));
     class_destroy(syscall_class);
     unregister_chrdev(major_number, DEVICE_NAME);
     
+    sm_rings_free(&sm_stream);
+    
+    // probes are gone, so nobody can still be reading the FSM
+    sm_tstate_flush();
+    kvfree(rcu_dereference_protected(active_fsm, 1));
+    kfree(rcu_dereference_protected(active_throttle, 1));
+    kvfree(rcu_dereference_protected(active_paths, 1));
+    if (rcu_dereference_protected(active_config, 1) != &sm_config_default)
+        kfree(rcu_dereference_protected(active_config, 1));
+    sm_target_clear();
+    rcu_barrier();
+    
     printk(KERN_INFO "SYSCALL_MONITOR: Module unloaded\n");
 }
 
@@ -30,14 +30,24 @@ double run_benchmark() {
     return (end - start) / 1000.0;
 }
 
-int main() {
-    printf("OVERHEAD IMPACT ON SAMPLE PROGRAM\n");
-    
-    printf("Test Configuration:\n");
-    printf("  - Iterations: %d syscalls\n", ITERATIONS);
-    printf("  - Syscalls per iteration: open() + read() + close()\n");
-    printf("  - Total syscalls: %d\n", ITERATIONS * 3);
-    printf("  - File accessed: /etc/hostname\n\n");
+// Reload the kernel module with the given attachment backend
+int load_backend(const char* backend) {
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd),
+             "cd ~/syscall-monitor/kernel-module && "
+             "(sudo rmmod syscall_monitor 2>/dev/null; sudo insmod syscall_monitor.ko backend=%s)",
+             backend);
+    return system(cmd);
+}
+
+// OFF baseline and LOG run for one backend
+void measure_backend(const char* backend, double* baseline_time, double* monitored_time) {
+    printf("Backend: %s\n", backend);
+    printf("Reloading module with backend=%s...\n", backend);
+    if (load_backend(backend) != 0) {
+        printf("ERROR: failed to load module with backend=%s\n", backend);
+        exit(1);
+    }
     
     // baseline (module OFF)
     printf("1: Baseline Test (Module in OFF mode)\n");
@@ -46,8 +56,8 @@ int main() {
     sleep(1);
     
     printf("Running benchmark (this may take a moment)...\n");
-    double baseline_time = run_benchmark();
-    printf("Baseline execution time: %.2f ms\n\n", baseline_time);
+    *baseline_time = run_benchmark();
+    printf("Baseline execution time: %.2f ms\n\n", *baseline_time);
     
     // monitoring (module LOG)
     printf("2: Monitoring Test (Module in LOG mode)\n");
@@ -56,24 +66,51 @@ int main() {
     sleep(1);
     
     printf("Running benchmark (this may take a moment)...\n");
-    double monitored_time = run_benchmark();
-    printf("Monitored execution time: %.2f ms\n\n", monitored_time);
+    *monitored_time = run_benchmark();
+    printf("Monitored execution time: %.2f ms\n\n", *monitored_time);
     
-    printf("Setting module back to OFF mode...\n");
+    printf("Setting module back to OFF mode...\n\n");
     system("cd ~/syscall-monitor/userspace && sudo ./syscall_control --off > /dev/null 2>&1");
+}
+
+int main() {
+    const char* backends[] = {"kprobe", "tracepoint"};
+    double baseline_time[2], monitored_time[2], overhead_percent[2], overhead_per_syscall_ns[2];
+    
+    printf("OVERHEAD IMPACT ON SAMPLE PROGRAM\n");
+    
+    printf("Test Configuration:\n");
+    printf("  - Iterations: %d syscalls\n", ITERATIONS);
+    printf("  - Syscalls per iteration: open() + read() + close()\n");
+    printf("  - Total syscalls: %d\n", ITERATIONS * 3);
+    printf("  - File accessed: /etc/hostname\n");
+    printf("  - Backends: kprobe, tracepoint\n\n");
     
-    // calculate overhead
-    double overhead_ms = monitored_time - baseline_time;
-    double overhead_percent = (overhead_ms / baseline_time) * 100.0;
-    double overhead_per_syscall_ns = (overhead_ms * 1000000.0) / (ITERATIONS * 3);
+    for (int b = 0; b < 2; b++) {
+        measure_backend(backends[b], &baseline_time[b], &monitored_time[b]);
+    }
+    load_backend("kprobe");
     
     // result
     printf("RESULTS SUMMARY\n");
-    printf("Baseline time (OFF mode):     %.2f ms\n", baseline_time);
-    printf("Monitored time (LOG mode):    %.2f ms\n", monitored_time);
-    printf("Absolute overhead:            %.2f ms\n", overhead_ms);
-    printf("Percentage overhead:          %.2f%%\n", overhead_percent);
-    printf("Per-syscall overhead:         %.2f ns\n\n", overhead_per_syscall_ns);
+    for (int b = 0; b < 2; b++) {
+        // calculate overhead
+        double overhead_ms = monitored_time[b] - baseline_time[b];
+        overhead_percent[b] = (overhead_ms / baseline_time[b]) * 100.0;
+        overhead_per_syscall_ns[b] = (overhead_ms * 1000000.0) / (ITERATIONS * 3);
+        
+        printf("[%s]\n", backends[b]);
+        printf("Baseline time (OFF mode):     %.2f ms\n", baseline_time[b]);
+        printf("Monitored time (LOG mode):    %.2f ms\n", monitored_time[b]);
+        printf("Absolute overhead:            %.2f ms\n", overhead_ms);
+        printf("Percentage overhead:          %.2f%%\n", overhead_percent[b]);
+        printf("Per-syscall overhead:         %.2f ns\n\n", overhead_per_syscall_ns[b]);
+    }
+    
+    printf("BACKEND COMPARISON:\n");
+    printf("  tracepoint vs kprobe per-syscall overhead: %.2f ns vs %.2f ns (%+.2f ns)\n\n",
+           overhead_per_syscall_ns[1], overhead_per_syscall_ns[0],
+           overhead_per_syscall_ns[1] - overhead_per_syscall_ns[0]);
     
     printf("BREAKDOWN:\n");
     printf("  Total syscalls performed: %d\n", ITERATIONS * 3);
@@ -82,21 +119,23 @@ int main() {
     
     printf("ANALYSIS:\n");
     
-    if (overhead_percent < 5) {
-        printf("✓ Overhead is NEGLIGIBLE (< 5%%)\n");
-        printf("  The kprobe overhead is minimal for fast syscalls.\n");
-    } else if (overhead_percent < 20) {
-        printf("⚠ Overhead is LOW-MEDIUM (5-20%%)\n");
-        printf("  Acceptable for monitoring purposes.\n");
-    } else if (overhead_percent < 50) {
-        printf("⚠ Overhead is MEDIUM-HIGH (20-50%%)\n");
-        printf("  May impact performance-critical applications.\n");
-    } else {
-        printf("✗ Overhead is HIGH (> 50%%)\n");
-        printf("  Significant performance impact. Consider optimizations:\n");
-        printf("  - Use relay buffers instead of printk\n");
-        printf("  - Implement batching to reduce logging frequency\n");
-        printf("  - Add per-PID filtering to reduce system-wide overhead\n");
+    for (int b = 0; b < 2; b++) {
+        printf("[%s] ", backends[b]);
+        if (overhead_percent[b] < 5) {
+            printf("✓ Overhead is NEGLIGIBLE (< 5%%)\n");
+            printf("  The probe overhead is minimal for fast syscalls.\n");
+        } else if (overhead_percent[b] < 20) {
+            printf("⚠ Overhead is LOW-MEDIUM (5-20%%)\n");
+            printf("  Acceptable for monitoring purposes.\n");
+        } else if (overhead_percent[b] < 50) {
+            printf("⚠ Overhead is MEDIUM-HIGH (20-50%%)\n");
+            printf("  May impact performance-critical applications.\n");
+        } else {
+            printf("✗ Overhead is HIGH (> 50%%)\n");
+            printf("  Significant performance impact. Consider optimizations:\n");
+            printf("  - Implement batching to reduce logging frequency\n");
+            printf("  - Add per-PID filtering to reduce system-wide overhead\n");
+        }
     }
     
     return 0;
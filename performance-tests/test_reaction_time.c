@@ -4,9 +4,27 @@
 #include <time.h>
 #include <string.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <poll.h>
 
-#define POLLING_INTERVAL_US 10000
+#define DETECTION_TIMEOUT_MS 5000
 #define MAX_ITERATIONS 5
+#define EVENT_BUF_SIZE 65536
+
+#define DEVICE_PATH "/dev/syscall_monitor"
+
+int device_fd = -1;
+
+// consume pending events without blocking, returns bytes consumed
+long drain_events() {
+    static char buf[EVENT_BUF_SIZE];
+    long total = 0;
+    ssize_t n;
+    while ((n = read(device_fd, buf, sizeof(buf))) > 0) {
+        total += n;
+    }
+    return total;
+}
 
 // current time
 double get_time_ms() {
@@ -19,10 +37,17 @@ int main() {
     printf("USERSPACE REACTION TIME AFTER SYSCALL OBSERVED\n");
     
     printf("Test Configuration:\n");
-    printf("  - Polling interval: %d ms\n", POLLING_INTERVAL_US / 1000);
+    printf("  - Detection: poll() + read() on %s\n", DEVICE_PATH);
     printf("  - Iterations: %d\n", MAX_ITERATIONS);
     printf("  - Syscall: fopen() which triggers open() and read()\n\n");
     
+    device_fd = open(DEVICE_PATH, O_RDONLY | O_NONBLOCK);
+    if (device_fd < 0) {
+        perror("Failed to open device");
+        printf("Make sure the kernel module is loaded.\n");
+        return 1;
+    }
+    
     double total_latency = 0.0;
     double min_latency = 999999.0;
     double max_latency = 0.0;
@@ -30,8 +55,8 @@ int main() {
     for (int i = 1; i <= MAX_ITERATIONS; i++) {
         printf("[Iteration %d/%d]\n", i, MAX_ITERATIONS);
         
-        printf("  Clearing kernel log...\n");
-        system("sudo dmesg -C > /dev/null 2>&1");
+        printf("  Draining event rings...\n");
+        drain_events();
         usleep(100000); // Wait 100ms
         
         // start time
@@ -45,30 +70,19 @@ int main() {
             fclose(f);
         }
        
-        printf("  Polling dmesg for detection...\n");
-        int found = 0;
-        int poll_count = 0;
-        while (!found) {
-            int ret = system("sudo dmesg 2>/dev/null | grep -q 'SYSCALL_MONITOR'");
-            if (ret == 0) {
-                found = 1;
-            } else {
-                usleep(POLLING_INTERVAL_US);
-                poll_count++;
-            }
-            
-            if (poll_count > 500) {
-                printf("  ERROR: Timeout waiting for syscall detection!\n");
-                printf("  Make sure the kernel module is loaded and in LOG mode.\n");
-                return 1;
-            }
+        printf("  Waiting for detection...\n");
+        struct pollfd pfd = { .fd = device_fd, .events = POLLIN };
+        if (poll(&pfd, 1, DETECTION_TIMEOUT_MS) <= 0 || drain_events() <= 0) {
+            printf("  ERROR: Timeout waiting for syscall detection!\n");
+            printf("  Make sure the kernel module is loaded and in LOG mode.\n");
+            return 1;
         }
         
         // end time
         double end_time = get_time_ms();
         double latency = end_time - start_time;
         
-        printf("  Detection latency: %.2f ms (after %d polls)\n\n", latency, poll_count);
+        printf("  Detection latency: %.3f ms\n\n", latency);
         
         total_latency += latency;
         if (latency < min_latency) min_latency = latency;
@@ -83,19 +97,21 @@ int main() {
     double avg_latency = total_latency / MAX_ITERATIONS;
     
     printf("RESULTS SUMMARY\n");
-    printf("Average detection latency: %.2f ms\n", avg_latency);
-    printf("Minimum detection latency: %.2f ms\n", min_latency);
-    printf("Maximum detection latency: %.2f ms\n", max_latency);
+    printf("Average detection latency: %.3f ms\n", avg_latency);
+    printf("Minimum detection latency: %.3f ms\n", min_latency);
+    printf("Maximum detection latency: %.3f ms\n", max_latency);
     printf("\n");
     
     printf("ANALYSIS:\n");
     printf("The detection latency includes:\n");
-    printf("  1. Time for kernel to log the syscall (printk)\n");
-    printf("  2. Time for dmesg to read kernel ring buffer\n");
-    printf("  3. Polling interval overhead (%d ms)\n", POLLING_INTERVAL_US / 1000);
+    printf("  1. Time for kernel to write the event record\n");
+    printf("  2. Wakeup of the sleeping reader\n");
+    printf("  3. Copying the records out with read()\n");
     printf("\n");
     
-    if (avg_latency < 50) {
+    if (avg_latency < 1) {
+        printf("CONCLUSION: Detection is event driven (< 1ms average).\n");
+    } else if (avg_latency < 50) {
         printf("CONCLUSION: Detection is reasonably fast (< 50ms average).\n");
     } else if (avg_latency < 100) {
         printf("CONCLUSION: Detection is moderate (50-100ms average).\n");
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,41 +10,310 @@
 #include <cjson/cJSON.h>
 #include <time.h>
 #include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <linux/types.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
 
 #define DEVICE_PATH "/dev/syscall_monitor"
 
+// Event ring layout (must match kernel-module/syscall_monitor.c). Records
+// are variable length: the header, then an optional argument or span section.
+#define SM_EVENT_ARGS 0x1
+#define SM_EVENT_PAD 0x2
+#define SM_EVENT_SPAN 0x4
+
+struct sm_event {
+    __u64 timestamp_ns;
+    __u32 pid;
+    __u32 tgid;
+    __u16 syscall_id;
+    __u8 mode;
+    __u8 outcome;
+    __u16 state_from;
+    __u16 state_to;
+    __u32 weight;
+    __u16 size;
+    __u16 flags;
+};
+
+#define SM_PATH_MAX 256
+
+struct sm_event_args {
+    __s32 fd;
+    __u32 flags;
+    __u64 count;
+    __u16 path_len;
+    __u16 reserved[3];
+    char path[];
+};
+
+// Coalesced calls of one pid on one fd, weight is their number
+struct sm_event_span {
+    __u64 last_ns;
+    __u64 bytes;
+    __s32 fd;
+    __u32 reserved;
+};
+
+#define SM_EVENT_MAX_SIZE \
+    ((sizeof(struct sm_event) + sizeof(struct sm_event_args) + SM_PATH_MAX + \
+      sizeof(struct sm_event) - 1) / sizeof(struct sm_event) * sizeof(struct sm_event))
+
+struct sm_ring_header {
+    __u64 head;
+    __u8 pad1[56];
+    __u64 tail;
+    __u8 pad2[56];
+    __u64 dropped;
+    __u32 data_size;
+    __u32 record_size;              // records are multiples of this size
+};
+
+struct sm_ring_info {
+    __u32 nr_cpus;
+    __u32 mmap_size;
+    __u32 data_size;
+    __u32 record_size;
+};
+
+struct sm_wakeup {
+    __u32 events;
+    __u32 usecs;
+};
+
+// openat path filter: NUL separated prefixes, '*' and '?' match within
+// one path component
+#define SM_PATHS_MAX_BYTES 16384
+
+struct sm_path_filter {
+    __u32 size;
+    __u32 reserved;
+    __u64 patterns;
+};
+
+struct sm_sampling {
+    __u32 ratio;
+    __u32 max_rate;
+};
+
+// Mode, syscalls, capture and sampling in one ioctl, applied atomically
+#define SM_CONFIG_VERSION 1
+#define SM_CONFIG_RESTART 0x1
+
+struct sm_monitor_config {
+    __u32 version;
+    __u32 mode;
+    __u32 syscall_mask;
+    __u32 capture_mask;
+    struct sm_sampling sampling;
+    __u32 flags;
+    __u32 coalesce_usecs;
+};
+
+// Per-open-file subscription with its own rings and filter
+#define SM_SUB_MAX_TGIDS 16
+
+struct sm_subscription {
+    struct sm_monitor_config config;
+    __u64 cgroup_id;
+    __u32 nr_tgids;
+    __u32 reserved;
+    __s32 tgids[SM_SUB_MAX_TGIDS];
+};
+
+// In-kernel FSM transition table
+#define SM_NR_SYSCALLS 8
+#define SM_FSM_MAX_STATES 64
+#define SM_FSM_NONE 0xff
+
+// FSM scopes
+#define SM_FSM_GLOBAL 0
+#define SM_FSM_PER_TGID 1
+#define SM_FSM_PER_PID 2
+
+struct sm_fsm_table {
+    __u32 num_states;
+    __u32 start_state;
+    __u32 scope;
+    __u32 reserved;
+    __u64 accept_mask;
+    __u8 next[SM_FSM_MAX_STATES][SM_NR_SYSCALLS];
+};
+
+// Several automata stepped side by side, their states numbered together
+#define SM_FSM_MAX_AUTOMATA 8
+#define SM_FSM_SET_MAX_STATES 8192
+#define SM_FSM_SET_NONE 0xffff
+
+struct sm_fsm_set {
+    __u32 num_states;
+    __u32 num_automata;
+    __u32 scope;
+    __u32 reserved;
+    __u32 start[SM_FSM_MAX_AUTOMATA];
+    __u64 next;                         // __u16 [num_states][SM_NR_SYSCALLS]
+    __u64 accept;                       // __u64 [num_states] rule bitmaps
+};
+
+// Per mode and syscall counters
+#define SM_NR_MODES 6
+
+struct sm_stat {
+    __u64 calls;
+    __u64 blocked;
+    __u64 throttled;
+    __u64 dropped;
+};
+
+struct sm_stats {
+    struct sm_stat count[SM_NR_MODES][SM_NR_SYSCALLS];
+};
+
+// Throttle buckets: rate calls/s refilled up to burst, rate 0 is unlimited
+#define SM_THROTTLE_DENY 1
+
+struct sm_throttle_config {
+    __u32 rate[SM_NR_SYSCALLS];
+    __u32 burst[SM_NR_SYSCALLS];
+    __u32 flags;
+    __u32 reserved;
+};
+
+// Latency histograms: bucket b counts calls that took [2^(b-1), 2^b) ns
+#define SM_LAT_BUCKETS 64
+
+struct sm_latency {
+    __u64 buckets[SM_NR_SYSCALLS][SM_LAT_BUCKETS];
+    __u64 total_ns[SM_NR_SYSCALLS];
+    __u64 missed;
+};
+
+// cgroup v2 targets, by cgroup id; DESCENDANTS also targets the subtree
+#define SM_CGROUP_DESCENDANTS 0x1
+
+struct sm_cgroup_target {
+    __u64 id;
+    __u32 flags;
+    __u32 reserved;
+};
+
 // ioctl commands
 #define IOCTL_SET_MODE _IOW('s', 1, int)
 #define IOCTL_SET_SYSCALL _IOW('s', 2, int)
 #define IOCTL_SET_PID _IOW('s', 3, int)
+#define IOCTL_GET_RING_INFO _IOR('s', 4, struct sm_ring_info)
+#define IOCTL_SET_WAKEUP _IOW('s', 5, struct sm_wakeup)
+#define IOCTL_SET_FSM _IOW('s', 6, struct sm_fsm_table)
+#define IOCTL_ADD_PID _IOW('s', 7, int)
+#define IOCTL_DEL_PID _IOW('s', 8, int)
+#define IOCTL_ADD_TGID _IOW('s', 9, int)
+#define IOCTL_DEL_TGID _IOW('s', 10, int)
+#define IOCTL_CLEAR_TARGETS _IO('s', 11)
+#define IOCTL_SET_SYSCALL_MASK _IOW('s', 12, __u32)
+#define IOCTL_GET_LATENCY _IOR('s', 13, struct sm_latency)
+#define IOCTL_GET_STATS _IOR('s', 14, struct sm_stats)
+#define IOCTL_SET_THROTTLE _IOW('s', 15, struct sm_throttle_config)
+#define IOCTL_SET_SAMPLING _IOW('s', 16, struct sm_sampling)
+#define IOCTL_SET_CAPTURE _IOW('s', 17, __u32)
+#define IOCTL_SET_PATHS _IOW('s', 18, struct sm_path_filter)
+#define IOCTL_ADD_CGROUP _IOW('s', 19, struct sm_cgroup_target)
+#define IOCTL_DEL_CGROUP _IOW('s', 20, struct sm_cgroup_target)
+#define IOCTL_SET_FOLLOW _IOW('s', 21, __u32)
+#define IOCTL_SET_CONFIG _IOW('s', 22, struct sm_monitor_config)
+#define IOCTL_GET_CONFIG _IOR('s', 23, struct sm_monitor_config)
+#define IOCTL_SUBSCRIBE _IOW('s', 24, struct sm_subscription)
+#define IOCTL_SET_FSM_SET _IOW('s', 25, struct sm_fsm_set)
 
 // Modes
 #define MODE_OFF 0
 #define MODE_LOG 1
 #define MODE_BLOCK 2
+#define MODE_FSM 3
+#define MODE_LATENCY 4
+#define MODE_THROTTLE 5
 
 // Syscall types
 #define SYSCALL_OPEN 0
 #define SYSCALL_READ 1
 #define SYSCALL_WRITE 2
+#define SYSCALL_CLOSE 3
+#define SYSCALL_MMAP 4
+#define SYSCALL_CONNECT 5
+#define SYSCALL_ACCEPT 6
+#define SYSCALL_EXECVE 7
+
+// Event outcomes
+#define OUTCOME_LOGGED 0
+#define OUTCOME_BLOCKED 1
+#define OUTCOME_FSM_TRANSITION 2
+#define OUTCOME_FSM_ACCEPT 3
+#define OUTCOME_THROTTLED 4
 
 int device_fd = -1;
 
-// FSM structure
+// Set by SIGINT/SIGTERM once catch_stop_signals() ran, ends wait_events()
+static volatile sig_atomic_t stop_requested = 0;
+
+// Mapped per-CPU event ring
 typedef struct {
-    char **states;
-    int num_states;
-    int current_state;
+    struct sm_ring_header *hdr;
+    char *data;
+} EventRing;
+
+EventRing *rings = NULL;
+int num_rings = 0;
+size_t ring_mmap_size = 0;
+
+typedef void (*event_handler_t)(const struct sm_event *ev, void *ctx);
+
+// FSM structure: a set of rules merged into at most SM_FSM_MAX_AUTOMATA
+// automata by load_fsm()
+typedef struct {
+    int num_rules;
+    char **rule_names;                  // bit i of an accept bitmap is rule i
+    int scope;
+    int num_automata;
+    __u32 start[SM_FSM_MAX_AUTOMATA];
+    int num_states;                     // over all automata
+    __u16 (*next)[SM_NR_SYSCALLS];      // SM_FSM_SET_NONE if the syscall is ignored
+    uint64_t *accept;                   // rules that accept on entering a state
 } FSM;
 
 // Function prototypes
 int open_device();
 void close_device();
+int map_rings();
+void unmap_rings();
+int drain_events(event_handler_t handler, void *ctx);
+int wait_events();
+void catch_stop_signals();
+int set_wakeup(int events, int usecs);
+void print_event(const struct sm_event *ev, void *ctx);
+void watch_events(const char* output);
 int set_mode(int mode);
-int set_syscall(const char* syscall_name);
+int print_latency();
+int print_stats();
+int set_config(int mode, const char* syscalls, const char* capture, int sample_ratio, int max_rate,
+               int coalesce_usecs);
 int set_pid(int pid);
-FSM* load_fsm(const char* filename);
+int set_throttle(const char* spec, int deny);
+int set_paths(const char* list);
+int update_targets(unsigned long cmd, const char* what, char* list);
+int update_cgroups(unsigned long cmd, char* list, int descendants);
+int set_follow(int on);
+int subscribe(const char* syscalls, const char* capture, int sample_ratio, int max_rate,
+              int coalesce_usecs, char* tgids, const char* cgroup);
+int clear_targets();
+FSM* load_fsm(char** paths, int num_paths);
 void free_fsm(FSM* fsm);
+int upload_fsm(FSM* fsm);
 void run_fsm(FSM* fsm);
 int syscall_name_to_type(const char* name);
 const char* syscall_type_to_name(int type);
@@ -55,82 +325,2225 @@ int open_device() {
         printf("Make sure the kernel module is loaded: sudo insmod syscall_monitor.ko\n");
         return -1;
     }
-    return 0;
+    return 0;
+}
+
+void close_device() {
+    if (device_fd >= 0) {
+        close(device_fd);
+        device_fd = -1;
+    }
+}
+
+// Map the event ring of every CPU
+int map_rings() {
+    struct sm_ring_info info;
+    
+    if (ioctl(device_fd, IOCTL_GET_RING_INFO, &info) < 0) {
+        perror("Failed to get ring info");
+        return -1;
+    }
+    // Records are read in place, one must never straddle the ring end
+    if (info.record_size == 0 || info.data_size % info.record_size) {
+        printf("[ERROR] Ring of %u bytes does not hold whole %u-byte records\n",
+               info.data_size, info.record_size);
+        return -1;
+    }
+    
+    rings = calloc(info.nr_cpus, sizeof(EventRing));
+    if (!rings) {
+        perror("Failed to allocate event rings");
+        return -1;
+    }
+    ring_mmap_size = info.mmap_size;
+    
+    for (unsigned int cpu = 0; cpu < info.nr_cpus; cpu++) {
+        void *base = mmap(NULL, info.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          device_fd, (off_t)cpu * info.mmap_size);
+        if (base == MAP_FAILED) {
+            perror("Failed to map event ring");
+            unmap_rings();
+            return -1;
+        }
+        
+        rings[cpu].hdr = base;
+        rings[cpu].data = (char *)base + (info.mmap_size - info.data_size);
+        num_rings++;
+    }
+    
+    return 0;
+}
+
+void unmap_rings() {
+    for (int cpu = 0; cpu < num_rings; cpu++) {
+        munmap(rings[cpu].hdr, ring_mmap_size);
+    }
+    free(rings);
+    rings = NULL;
+    num_rings = 0;
+}
+
+// Consume all pending events, returns the number consumed
+int drain_events(event_handler_t handler, void *ctx) {
+    int count = 0;
+    
+    for (int cpu = 0; cpu < num_rings; cpu++) {
+        struct sm_ring_header *hdr = rings[cpu].hdr;
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = hdr->tail;
+        
+        while (tail < head) {
+            const struct sm_event *ev =
+                (const struct sm_event *)(rings[cpu].data + (tail & (hdr->data_size - 1)));
+            if (ev->size < hdr->record_size) {
+                tail = head;        // corrupt, skip what is left
+                break;
+            }
+            if (!(ev->flags & SM_EVENT_PAD)) {
+                if (handler) handler(ev, ctx);
+                count++;
+            }
+            tail += ev->size;
+        }
+        
+        __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+    }
+    
+    return count;
+}
+
+// Sleep until the module reports pending events
+int wait_events() {
+    struct pollfd pfd = { .fd = device_fd, .events = POLLIN };
+    
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            perror("Failed to poll device");
+            return -1;
+        }
+        if (stop_requested) return -1;
+    }
+    
+    return 0;
+}
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Let Ctrl+C end wait_events() instead of the process, so buffered
+// output can still be written
+void catch_stop_signals() {
+    struct sigaction sa = { .sa_handler = request_stop };
+    
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// Set reader wakeup coalescing
+int set_wakeup(int events, int usecs) {
+    struct sm_wakeup wakeup = { .events = events, .usecs = usecs };
+    
+    if (ioctl(device_fd, IOCTL_SET_WAKEUP, &wakeup) < 0) {
+        perror("Failed to set wakeup");
+        return -1;
+    }
+    
+    printf("[INFO] Wakeup after %d events or %d us\n", events, usecs);
+    return 0;
+}
+
+void print_event(const struct sm_event *ev, void *ctx) {
+    const char* outcome_str[] = {"logged", "blocked", "transition", "accept", "throttled"};
+    (void)ctx;
+    printf("[EVENT] %llu.%09llu PID=%u TGID=%u %s() %s",
+           (unsigned long long)(ev->timestamp_ns / 1000000000ULL),
+           (unsigned long long)(ev->timestamp_ns % 1000000000ULL),
+           ev->pid, ev->tgid, syscall_type_to_name(ev->syscall_id),
+           ev->outcome <= OUTCOME_THROTTLED ? outcome_str[ev->outcome] : "unknown");
+    if (ev->outcome == OUTCOME_FSM_TRANSITION || ev->outcome == OUTCOME_FSM_ACCEPT) {
+        printf(" %u -> %u", ev->state_from, ev->state_to);
+    }
+    if (ev->flags & SM_EVENT_SPAN) {
+        const struct sm_event_span *span = (const struct sm_event_span *)(ev + 1);
+        
+        printf(" fd=%d calls=%u", span->fd, ev->weight);
+        if (span->bytes) {
+            printf(" bytes=%llu", (unsigned long long)span->bytes);
+        }
+        printf(" over %lluus", (unsigned long long)(span->last_ns - ev->timestamp_ns) / 1000);
+    }
+    if (ev->flags & SM_EVENT_ARGS) {
+        const struct sm_event_args *args = (const struct sm_event_args *)(ev + 1);
+        
+        printf(" fd=%d", args->fd);
+        if (ev->syscall_id == SYSCALL_READ || ev->syscall_id == SYSCALL_WRITE) {
+            printf(" count=%llu", (unsigned long long)args->count);
+        } else if (ev->syscall_id == SYSCALL_OPEN || ev->syscall_id == SYSCALL_MMAP) {
+            printf(" flags=0x%x", args->flags);
+        }
+        if (args->path_len) {
+            printf(" path=\"%s\"", args->path);
+        }
+    }
+    if (ev->weight > 1 && !(ev->flags & SM_EVENT_SPAN)) {
+        printf(" (x%u)", ev->weight);
+    }
+    printf("\n");
+}
+
+// Compact trace files. A header carries the format version and the
+// syscall names as schema, then each record is three bytes (syscall id,
+// mode, kind) followed by LEB128 varints: timestamp and pid as deltas
+// from the previous record, signed values zigzag encoded. Sections only
+// present in the ring record follow in order, most records take 6 to 8
+// bytes instead of 32.
+#define SM_TRACE_MAGIC "SMTRACE"
+#define SM_TRACE_VERSION 1
+#define SM_TRACE_NAME_LEN 16
+#define SM_TRACE_REC_MAX 512            // bound on one encoded record
+#define SM_TRACE_BUF_SIZE (1 << 20)
+
+// Record kind byte: the outcome and which sections follow
+#define SM_TRACE_OUTCOME 0x07
+#define SM_TRACE_WEIGHT 0x08            // weight other than 1
+#define SM_TRACE_STATES 0x10            // state_from, state_to
+#define SM_TRACE_ARGS 0x20              // fd, flags, count, path
+#define SM_TRACE_SPAN 0x40              // last_ns delta, bytes, fd
+
+// Header fields are in the byte order of the recording host
+struct sm_trace_header {
+    char magic[8];
+    __u32 version;
+    __u32 header_size;                  // including the schema
+    __u32 nr_syscalls;
+    __u32 reserved;
+    // nr_syscalls names of SM_TRACE_NAME_LEN bytes, indexed by syscall id
+};
+
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    uint64_t prev_ts;
+    uint32_t prev_pid;
+    uint64_t events;
+    uint64_t bytes;                     // written to fd so far
+    int error;
+} TraceWriter;
+
+typedef struct {
+    const uint8_t *base;
+    const uint8_t *p;
+    const uint8_t *end;
+    size_t size;
+    uint64_t prev_ts;
+    uint32_t prev_pid;
+    __u16 id_map[256];                  // trace syscall id to ours
+} TraceReader;
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// NULL if the varint runs past end or past 64 bits
+static inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v) {
+    uint64_t x = 0;
+    
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = *p++;
+        
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Encode one ring record, returns its size (at most SM_TRACE_REC_MAX)
+static size_t trace_encode(TraceWriter* w, const struct sm_event *ev, uint8_t *out) {
+    uint8_t *p = out;
+    uint8_t kind = ev->outcome & SM_TRACE_OUTCOME;
+    
+    if (ev->weight != 1) kind |= SM_TRACE_WEIGHT;
+    if (ev->outcome == OUTCOME_FSM_TRANSITION || ev->outcome == OUTCOME_FSM_ACCEPT) {
+        kind |= SM_TRACE_STATES;
+    }
+    if (ev->flags & SM_EVENT_ARGS) kind |= SM_TRACE_ARGS;
+    if (ev->flags & SM_EVENT_SPAN) kind |= SM_TRACE_SPAN;
+    
+    *p++ = (uint8_t)ev->syscall_id;
+    *p++ = ev->mode;
+    *p++ = kind;
+    // Rings are drained one CPU at a time, so deltas go backwards too
+    p = put_varint(p, zigzag((int64_t)(ev->timestamp_ns - w->prev_ts)));
+    p = put_varint(p, zigzag((int32_t)(ev->pid - w->prev_pid)));
+    p = put_varint(p, zigzag((int32_t)(ev->pid - ev->tgid)));
+    w->prev_ts = ev->timestamp_ns;
+    w->prev_pid = ev->pid;
+    
+    if (kind & SM_TRACE_WEIGHT) {
+        p = put_varint(p, ev->weight);
+    }
+    if (kind & SM_TRACE_STATES) {
+        p = put_varint(p, ev->state_from);
+        p = put_varint(p, ev->state_to);
+    }
+    if (kind & SM_TRACE_ARGS) {
+        const struct sm_event_args *args = (const struct sm_event_args *)(ev + 1);
+        size_t len = args->path_len > SM_PATH_MAX ? SM_PATH_MAX : args->path_len;
+        
+        p = put_varint(p, zigzag(args->fd));
+        p = put_varint(p, args->flags);
+        p = put_varint(p, args->count);
+        p = put_varint(p, len);
+        if (len > 1) {
+            memcpy(p, args->path, len - 1);     // the NUL is implied
+            p += len - 1;
+        }
+    }
+    if (kind & SM_TRACE_SPAN) {
+        const struct sm_event_span *span = (const struct sm_event_span *)(ev + 1);
+        
+        p = put_varint(p, span->last_ns - ev->timestamp_ns);
+        p = put_varint(p, span->bytes);
+        p = put_varint(p, zigzag(span->fd));
+    }
+    
+    return p - out;
+}
+
+// Decode one record into a ring record at ev (SM_EVENT_MAX_SIZE bytes).
+// Returns 1 for an event, 0 at the end and -1 on a truncated record.
+static int trace_next(TraceReader* r, struct sm_event *ev) {
+    const uint8_t *p = r->p;
+    const uint8_t *end = r->end;
+    uint64_t ts, pid, tgid, v;
+    uint8_t kind;
+    
+    if (p == end) return 0;
+    if (end - p < 3) return -1;
+    
+    memset(ev, 0, sizeof(*ev));
+    ev->syscall_id = r->id_map[p[0]];
+    ev->mode = p[1];
+    kind = p[2];
+    p += 3;
+    ev->outcome = kind & SM_TRACE_OUTCOME;
+    ev->weight = 1;
+    ev->size = sizeof(*ev);
+    
+    if (!(p = get_varint(p, end, &ts)) || !(p = get_varint(p, end, &pid)) ||
+        !(p = get_varint(p, end, &tgid))) {
+        return -1;
+    }
+    r->prev_ts += unzigzag(ts);
+    r->prev_pid += (uint32_t)unzigzag(pid);
+    ev->timestamp_ns = r->prev_ts;
+    ev->pid = r->prev_pid;
+    ev->tgid = ev->pid - (uint32_t)unzigzag(tgid);
+    
+    if (kind & SM_TRACE_WEIGHT) {
+        if (!(p = get_varint(p, end, &v))) return -1;
+        ev->weight = v;
+    }
+    if (kind & SM_TRACE_STATES) {
+        if (!(p = get_varint(p, end, &v))) return -1;
+        ev->state_from = v;
+        if (!(p = get_varint(p, end, &v))) return -1;
+        ev->state_to = v;
+    }
+    if (kind & SM_TRACE_ARGS) {
+        struct sm_event_args *args = (struct sm_event_args *)(ev + 1);
+        uint64_t fd, flags, count, len;
+        
+        if (!(p = get_varint(p, end, &fd)) || !(p = get_varint(p, end, &flags)) ||
+            !(p = get_varint(p, end, &count)) || !(p = get_varint(p, end, &len)) ||
+            len > SM_PATH_MAX || (len > 1 && (uint64_t)(end - p) < len - 1)) {
+            return -1;
+        }
+        memset(args, 0, sizeof(*args));
+        args->fd = (__s32)unzigzag(fd);
+        args->flags = flags;
+        args->count = count;
+        args->path_len = len;
+        if (len) {
+            memcpy(args->path, p, len - 1);
+            args->path[len - 1] = '\0';
+            p += len - 1;
+        }
+        ev->flags |= SM_EVENT_ARGS;
+        ev->size += sizeof(*args) + len;
+    }
+    if (kind & SM_TRACE_SPAN) {
+        struct sm_event_span *span = (struct sm_event_span *)(ev + 1);
+        uint64_t last, bytes, fd;
+        
+        if (!(p = get_varint(p, end, &last)) || !(p = get_varint(p, end, &bytes)) ||
+            !(p = get_varint(p, end, &fd))) {
+            return -1;
+        }
+        span->last_ns = ev->timestamp_ns + last;
+        span->bytes = bytes;
+        span->fd = (__s32)unzigzag(fd);
+        span->reserved = 0;
+        ev->flags |= SM_EVENT_SPAN;
+        ev->size += sizeof(*span);
+    }
+    
+    ev->size = (ev->size + sizeof(*ev) - 1) / sizeof(*ev) * sizeof(*ev);
+    r->p = p;
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int trace_flush(TraceWriter* w) {
+    if (w->len && !w->error) {
+        if (write_all(w->fd, w->buf, w->len) < 0) {
+            perror("Failed to write trace");
+            w->error = 1;
+        } else {
+            w->bytes += w->len;
+        }
+    }
+    w->len = 0;
+    return w->error ? -1 : 0;
+}
+
+// Create path and buffer its header
+int trace_open(TraceWriter* w, const char* path) {
+    struct sm_trace_header *hdr;
+    
+    memset(w, 0, sizeof(*w));
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        perror("Failed to create trace");
+        return -1;
+    }
+    w->buf = malloc(SM_TRACE_BUF_SIZE);
+    if (!w->buf) {
+        close(w->fd);
+        return -1;
+    }
+    
+    hdr = (struct sm_trace_header *)w->buf;
+    memset(hdr, 0, sizeof(*hdr) + SM_NR_SYSCALLS * SM_TRACE_NAME_LEN);
+    memcpy(hdr->magic, SM_TRACE_MAGIC, sizeof(SM_TRACE_MAGIC));
+    hdr->version = SM_TRACE_VERSION;
+    hdr->header_size = sizeof(*hdr) + SM_NR_SYSCALLS * SM_TRACE_NAME_LEN;
+    hdr->nr_syscalls = SM_NR_SYSCALLS;
+    for (int i = 0; i < SM_NR_SYSCALLS; i++) {
+        strncpy((char *)(hdr + 1) + i * SM_TRACE_NAME_LEN, syscall_type_to_name(i),
+                SM_TRACE_NAME_LEN - 1);
+    }
+    w->len = hdr->header_size;
+    
+    return 0;
+}
+
+int trace_write(TraceWriter* w, const struct sm_event *ev) {
+    if (w->len + SM_TRACE_REC_MAX > SM_TRACE_BUF_SIZE && trace_flush(w) < 0) {
+        return -1;
+    }
+    w->len += trace_encode(w, ev, w->buf + w->len);
+    w->events++;
+    return 0;
+}
+
+int trace_close(TraceWriter* w) {
+    int ret = trace_flush(w);
+    
+    if (close(w->fd) < 0 && ret == 0) {
+        perror("Failed to close trace");
+        ret = -1;
+    }
+    free(w->buf);
+    w->buf = NULL;
+    return ret;
+}
+
+// Map a trace read-only and check its header
+int trace_map(TraceReader* r, const char* path) {
+    const struct sm_trace_header *hdr;
+    struct stat st;
+    void *base;
+    int fd;
+    
+    memset(r, 0, sizeof(*r));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to open trace");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        printf("[ERROR] %s is not a trace\n", path);
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Failed to map trace");
+        return -1;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    r->base = base;
+    r->size = st.st_size;
+    
+    hdr = base;
+    if (memcmp(hdr->magic, SM_TRACE_MAGIC, sizeof(SM_TRACE_MAGIC)) != 0 ||
+        hdr->version != SM_TRACE_VERSION || hdr->nr_syscalls > 256 ||
+        hdr->header_size < sizeof(*hdr) + (size_t)hdr->nr_syscalls * SM_TRACE_NAME_LEN ||
+        hdr->header_size > r->size) {
+        printf("[ERROR] %s is not a version %d trace\n", path, SM_TRACE_VERSION);
+        munmap(base, r->size);
+        return -1;
+    }
+    
+    // Ids follow the recording host's names, unknown ones print as such
+    for (int i = 0; i < 256; i++) {
+        r->id_map[i] = 0xffff;
+    }
+    for (__u32 i = 0; i < hdr->nr_syscalls; i++) {
+        char name[SM_TRACE_NAME_LEN];
+        int type;
+        
+        memcpy(name, (const char *)(hdr + 1) + i * SM_TRACE_NAME_LEN, SM_TRACE_NAME_LEN);
+        name[SM_TRACE_NAME_LEN - 1] = '\0';
+        type = syscall_name_to_type(name);
+        if (type >= 0) r->id_map[i] = type;
+    }
+    
+    r->p = r->base + hdr->header_size;
+    r->end = r->base + r->size;
+    return 0;
+}
+
+void trace_unmap(TraceReader* r) {
+    munmap((void *)r->base, r->size);
+    r->base = NULL;
+}
+
+static void write_event(const struct sm_event *ev, void *ctx) {
+    trace_write(ctx, ev);
+}
+
+static void print_event_csv(const struct sm_event *ev) {
+    const char* mode_str[] = {"OFF", "LOG", "BLOCK", "FSM", "LATENCY", "THROTTLE"};
+    const char* outcome_str[] = {"logged", "blocked", "transition", "accept", "throttled"};
+    
+    printf("%llu,%u,%u,%s,%s,%s,%u,%u,%u",
+           (unsigned long long)ev->timestamp_ns, ev->pid, ev->tgid,
+           syscall_type_to_name(ev->syscall_id),
+           ev->mode < SM_NR_MODES ? mode_str[ev->mode] : "unknown",
+           ev->outcome <= OUTCOME_THROTTLED ? outcome_str[ev->outcome] : "unknown",
+           ev->state_from, ev->state_to, ev->weight);
+    if (ev->flags & SM_EVENT_ARGS) {
+        const struct sm_event_args *args = (const struct sm_event_args *)(ev + 1);
+        
+        printf(",%d,%u,%llu,,,\"", args->fd, args->flags, (unsigned long long)args->count);
+        for (const char *c = args->path; args->path_len && *c; c++) {
+            if (*c == '"') putchar('"');
+            putchar(*c);
+        }
+        printf("\"\n");
+    } else if (ev->flags & SM_EVENT_SPAN) {
+        const struct sm_event_span *span = (const struct sm_event_span *)(ev + 1);
+        
+        printf(",%d,,,%llu,%llu,\n", span->fd, (unsigned long long)span->bytes,
+               (unsigned long long)span->last_ns);
+    } else {
+        printf(",,,,,,\n");
+    }
+}
+
+// Print a recorded trace as text or CSV, stats go to stderr
+int decode_trace(const char* path, int csv) {
+    union {
+        struct sm_event ev;
+        char bytes[SM_EVENT_MAX_SIZE];
+    } buf;
+    struct sm_event *ev = &buf.ev;
+    struct timespec start, stop;
+    unsigned long long count = 0;
+    TraceReader r;
+    double secs;
+    int ret;
+    
+    if (trace_map(&r, path) < 0) {
+        return -1;
+    }
+    setvbuf(stdout, NULL, _IOFBF, SM_TRACE_BUF_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    if (csv) {
+        printf("timestamp_ns,pid,tgid,syscall,mode,outcome,state_from,state_to,weight,"
+               "fd,flags,count,bytes,last_ns,path\n");
+    }
+    while ((ret = trace_next(&r, ev)) > 0) {
+        if (csv) {
+            print_event_csv(ev);
+        } else {
+            print_event(ev, NULL);
+        }
+        count++;
+    }
+    fflush(stdout);
+    
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    if (ret < 0) {
+        fprintf(stderr, "[ERROR] Truncated record at offset %zu\n", (size_t)(r.p - r.base));
+    }
+    fprintf(stderr, "[INFO] Decoded %llu events (%zu bytes) in %.3fs, %.0f events/s\n",
+            count, r.size, secs, secs > 0 ? count / secs : 0.0);
+    trace_unmap(&r);
+    
+    return ret < 0 ? -1 : 0;
+}
+
+// Print events as they arrive, or record them to a trace at output
+void watch_events(const char* output) {
+    TraceWriter trace;
+    
+    if (map_rings() < 0) return;
+    
+    if (output) {
+        if (trace_open(&trace, output) < 0) return;
+        catch_stop_signals();
+        printf("[INFO] Recording events to %s, press Ctrl+C to stop\n", output);
+    } else {
+        printf("[INFO] Watching events, press Ctrl+C to stop\n");
+    }
+    
+    while (wait_events() == 0) {
+        if (output) {
+            drain_events(write_event, &trace);
+            if (trace.error) break;
+        } else {
+            drain_events(print_event, NULL);
+            fflush(stdout);
+        }
+    }
+    
+    if (output) {
+        drain_events(write_event, &trace);
+        trace_close(&trace);
+        printf("[INFO] Recorded %llu events in %llu bytes\n",
+               (unsigned long long)trace.events, (unsigned long long)trace.bytes);
+    }
+}
+
+// Collector daemon: one consumer thread per ring, pinned to its CPU,
+// copies records in batches and hands them to the writer through a
+// lock-free single producer, single consumer queue. Batches go back on
+// a second queue once written, so nothing is allocated while running.
+#define SM_BATCH_SIZE (64 * 1024)
+#define SM_QUEUE_SLOTS 16               // power of two, also batches per CPU
+#define SM_ROTATE_MB 64
+
+typedef struct {
+    size_t len;
+    char data[SM_BATCH_SIZE];
+} Batch;
+
+typedef struct {
+    uint64_t head;                      // written by the producer only
+    char pad1[56];
+    uint64_t tail;                      // written by the consumer only
+    char pad2[56];
+    Batch *slot[SM_QUEUE_SLOTS];
+} SpscQueue;
+
+typedef struct {
+    SpscQueue full;                     // consumer to writer
+    SpscQueue free;                     // writer back to consumer
+    Batch *batches;
+    pthread_t thread;
+    int cpu;
+    int exited;                         // set last, the queue is final then
+    uint64_t stalls;                    // no free batch, the writer is behind
+} Consumer;
+
+static int spsc_push(SpscQueue *q, Batch *b) {
+    uint64_t head = q->head;
+    
+    if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == SM_QUEUE_SLOTS) {
+        return -1;
+    }
+    q->slot[head & (SM_QUEUE_SLOTS - 1)] = b;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static Batch *spsc_pop(SpscQueue *q) {
+    uint64_t tail = q->tail;
+    Batch *b;
+    
+    if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    b = q->slot[tail & (SM_QUEUE_SLOTS - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return b;
+}
+
+// Copy whole records of one ring into b until it is empty or b is full,
+// returns the number copied
+static int drain_ring_batch(EventRing *ring, Batch *b) {
+    struct sm_ring_header *hdr = ring->hdr;
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = hdr->tail;
+    int count = 0;
+    
+    while (tail < head) {
+        const struct sm_event *ev =
+            (const struct sm_event *)(ring->data + (tail & (hdr->data_size - 1)));
+        if (ev->size < hdr->record_size) {
+            tail = head;            // corrupt, skip what is left
+            break;
+        }
+        if (!(ev->flags & SM_EVENT_PAD)) {
+            if (b->len + ev->size > SM_BATCH_SIZE) break;
+            memcpy(b->data + b->len, ev, ev->size);
+            b->len += ev->size;
+            count++;
+        }
+        tail += ev->size;
+    }
+    
+    __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void *consume_ring(void *arg) {
+    Consumer *c = arg;
+    struct pollfd pfd = { .fd = device_fd, .events = POLLIN };
+    cpu_set_t set;
+    int backoff = 0;
+    int final_passes = -1;
+    
+    // An offline CPU has an idle ring, its thread may run anywhere
+    CPU_ZERO(&set);
+    CPU_SET(c->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    
+    // After the stop request the ring is drained until empty, but for no
+    // more than about one ring's worth in case the producers keep going
+    while (final_passes != 0) {
+        Batch *b;
+        int count;
+        
+        if (stop_requested && final_passes < 0) {
+            final_passes = rings[c->cpu].hdr->data_size / SM_BATCH_SIZE + 1;
+        }
+        b = spsc_pop(&c->free);
+        if (!b) {
+            c->stalls++;
+            usleep(1000);
+            continue;
+        }
+        
+        b->len = 0;
+        count = drain_ring_batch(&rings[c->cpu], b);
+        if (final_passes > 0) final_passes--;
+        if (count) {
+            spsc_push(&c->full, b);     // never full, it has a slot per batch
+            backoff = 0;
+            continue;
+        }
+        
+        // Readiness covers every ring, back off while only others have data
+        spsc_push(&c->free, b);
+        if (final_passes >= 0) break;
+        if (backoff) {
+            usleep(1000);
+        } else {
+            poll(&pfd, 1, 100);
+        }
+        backoff = !backoff;
+    }
+    
+    __atomic_store_n(&c->exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Open the next file of the daemon, its blocks allocated up front so
+// the sequential writes do not extend it piece by piece
+static int open_rotated(TraceWriter* w, const char* dir, unsigned int seq, size_t size) {
+    char path[4096];
+    
+    snprintf(path, sizeof(path), "%s/events-%06u.smt", dir, seq);
+    if (trace_open(w, path) < 0) {
+        return -1;
+    }
+    if (fallocate(w->fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && errno != EOPNOTSUPP) {
+        perror("Failed to preallocate trace");
+    }
+    printf("[INFO] Writing %s\n", path);
+    return 0;
+}
+
+// Collect every ring into dir, a new file every rotate_mb megabytes,
+// until SIGINT or SIGTERM
+int run_daemon(const char* dir, int rotate_mb) {
+    size_t rotate = (size_t)(rotate_mb > 0 ? rotate_mb : SM_ROTATE_MB) << 20;
+    unsigned long long events = 0, bytes = 0, stalls = 0, dropped = 0;
+    unsigned int seq = 0, files = 0;
+    Consumer *consumers;
+    TraceWriter trace;
+    int started = 0;
+    int ret = -1;
+    
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create output directory");
+        return -1;
+    }
+    if (map_rings() < 0) {
+        return -1;
+    }
+    
+    consumers = calloc(num_rings, sizeof(Consumer));
+    if (!consumers) {
+        unmap_rings();
+        return -1;
+    }
+    for (int cpu = 0; cpu < num_rings; cpu++) {
+        Consumer *c = &consumers[cpu];
+        
+        c->cpu = cpu;
+        c->batches = malloc(SM_QUEUE_SLOTS * sizeof(Batch));
+        if (!c->batches) goto out;
+        for (int i = 0; i < SM_QUEUE_SLOTS; i++) {
+            spsc_push(&c->free, &c->batches[i]);
+        }
+    }
+    
+    if (open_rotated(&trace, dir, seq, rotate) < 0) {
+        goto out;
+    }
+    files++;
+    catch_stop_signals();
+    for (; started < num_rings; started++) {
+        if (pthread_create(&consumers[started].thread, NULL, consume_ring,
+                           &consumers[started]) != 0) {
+            printf("[ERROR] Failed to start consumer for CPU %d\n", started);
+            stop_requested = 1;
+            break;
+        }
+    }
+    printf("[INFO] Collecting %d rings, press Ctrl+C to stop\n", started);
+    
+    // The writer: drains every queue, sleeps only when all are empty. It
+    // keeps recycling batches after a stop until every consumer exited,
+    // then takes one more round for their last batches.
+    for (;;) {
+        int exited = stop_requested;
+        int idle = 1;
+        
+        for (int cpu = 0; exited && cpu < started; cpu++) {
+            exited = __atomic_load_n(&consumers[cpu].exited, __ATOMIC_ACQUIRE);
+        }
+        for (int cpu = 0; cpu < started; cpu++) {
+            Consumer *c = &consumers[cpu];
+            Batch *b;
+            
+            while ((b = spsc_pop(&c->full))) {
+                for (size_t off = 0; trace.buf && off < b->len; ) {
+                    const struct sm_event *ev = (const struct sm_event *)(b->data + off);
+                    
+                    trace_write(&trace, ev);
+                    off += ev->size;
+                }
+                spsc_push(&c->free, b);
+                idle = 0;
+            }
+        }
+        if (trace.buf && !trace.error && trace.bytes + trace.len >= rotate) {
+            bytes += trace.bytes + trace.len;
+            events += trace.events;
+            if (trace_close(&trace) == 0 && open_rotated(&trace, dir, ++seq, rotate) == 0) {
+                files++;
+            }
+        }
+        // A failed write or rotation stops the daemon, batches are still
+        // recycled so the consumers can exit
+        if (!trace.buf || trace.error) stop_requested = 1;
+        
+        if (exited) break;
+        if (idle) usleep(1000);
+    }
+    for (int cpu = 0; cpu < started; cpu++) {
+        pthread_join(consumers[cpu].thread, NULL);
+    }
+    
+    if (trace.buf) {
+        int error = trace.error;
+        
+        bytes += trace.bytes + trace.len;
+        events += trace.events;
+        ret = trace_close(&trace) < 0 || error ? -1 : 0;
+    }
+    for (int cpu = 0; cpu < num_rings; cpu++) {
+        stalls += consumers[cpu].stalls;
+        dropped += rings[cpu].hdr->dropped;
+    }
+    printf("[INFO] Collected %llu events in %u files (%llu bytes), %llu dropped by the module, "
+           "%llu consumer stalls\n", events, files, bytes, dropped, stalls);
+    
+out:
+    for (int cpu = 0; cpu < num_rings; cpu++) {
+        free(consumers[cpu].batches);
+    }
+    free(consumers);
+    unmap_rings();
+    return ret;
+}
+
+// Set mode via ioctl
+int set_mode(int mode) {
+    const char* mode_str[] = {"OFF", "LOG", "BLOCK", "FSM", "LATENCY", "THROTTLE"};
+    
+    if (ioctl(device_fd, IOCTL_SET_MODE, &mode) < 0) {
+        perror("Failed to set mode");
+        return -1;
+    }
+    
+    printf("[INFO] Mode changed to: %s\n", mode_str[mode]);
+    return 0;
+}
+
+// Print the module counters, skipping syscalls that never fired
+int print_stats() {
+    const char* mode_str[] = {"OFF", "LOG", "BLOCK", "FSM", "LATENCY", "THROTTLE"};
+    struct sm_stats stats;
+    
+    if (ioctl(device_fd, IOCTL_GET_STATS, &stats) < 0) {
+        perror("Failed to get stats");
+        return -1;
+    }
+    
+    printf("%-8s %-8s %12s %12s %12s %12s\n", "mode", "syscall", "calls", "blocked",
+           "throttled", "dropped");
+    for (int m = 0; m < SM_NR_MODES; m++) {
+        for (int s = 0; s < SM_NR_SYSCALLS; s++) {
+            const struct sm_stat *st = &stats.count[m][s];
+            
+            if (!st->calls && !st->dropped) continue;
+            printf("%-8s %-8s %12llu %12llu %12llu %12llu\n", mode_str[m], syscall_type_to_name(s),
+                   (unsigned long long)st->calls, (unsigned long long)st->blocked,
+                   (unsigned long long)st->throttled, (unsigned long long)st->dropped);
+        }
+    }
+    return 0;
+}
+
+// Upper bound in ns of the bucket holding the given fraction of calls
+static unsigned long long latency_percentile(const __u64 *buckets, __u64 count, double frac) {
+    __u64 rank = (__u64)(count * frac);
+    __u64 seen = 0;
+    
+    for (int b = 0; b < SM_LAT_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank)
+            return b ? 1ULL << b : 0;
+    }
+    return 0;
+}
+
+// Print p50/p99 per syscall from the summed kernel histograms. Percentiles
+// are bucket upper bounds, so they are accurate to a factor of two.
+int print_latency() {
+    struct sm_latency lat;
+    
+    if (ioctl(device_fd, IOCTL_GET_LATENCY, &lat) < 0) {
+        perror("Failed to get latency histograms");
+        return -1;
+    }
+    
+    printf("%-10s %12s %12s %12s %12s\n", "syscall", "calls", "avg(ns)", "p50(ns)", "p99(ns)");
+    for (int s = 0; s < SM_NR_SYSCALLS; s++) {
+        __u64 count = 0;
+        
+        for (int b = 0; b < SM_LAT_BUCKETS; b++) {
+            count += lat.buckets[s][b];
+        }
+        if (count == 0) continue;
+        
+        printf("%-10s %12llu %12llu %12llu %12llu\n", syscall_type_to_name(s),
+               (unsigned long long)count, (unsigned long long)(lat.total_ns[s] / count),
+               latency_percentile(lat.buckets[s], count, 0.50),
+               latency_percentile(lat.buckets[s], count, 0.99));
+    }
+    printf("[INFO] %llu calls not timed\n", (unsigned long long)lat.missed);
+    return 0;
+}
+
+// Syscall names, indexed by type
+const char* syscall_names[SM_NR_SYSCALLS] = {
+    "open", "read", "write", "close", "mmap", "connect", "accept", "execve"
+};
+
+// Convert syscall name to type
+int syscall_name_to_type(const char* name) {
+    for (int i = 0; i < SM_NR_SYSCALLS; i++) {
+        if (strcmp(name, syscall_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Convert syscall type to name
+const char* syscall_type_to_name(int type) {
+    if (type < 0 || type >= SM_NR_SYSCALLS) return "unknown";
+    return syscall_names[type];
+}
+
+// Parse a comma separated list of syscall names, or "all", into a mask
+static int parse_syscall_list(const char* names, __u32* mask) {
+    char list[256];
+    char* saveptr = NULL;
+    
+    *mask = 0;
+    snprintf(list, sizeof(list), "%s", names);
+    for (char* tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        int syscall_type = syscall_name_to_type(tok);
+        
+        if (strcmp(tok, "all") == 0) {
+            *mask = (1U << SM_NR_SYSCALLS) - 1;
+            continue;
+        }
+        if (syscall_type < 0) {
+            printf("[ERROR] Invalid syscall name: %s (must be: open, read, write, close, mmap, "
+                   "connect, accept, execve or all)\n", tok);
+            return -1;
+        }
+        *mask |= 1U << syscall_type;
+    }
+    
+    return 0;
+}
+
+// Change mode, monitored syscalls, argument capture and sampling with one
+// ioctl, so the module never runs with only some of them applied. Fields
+// given as -1 or NULL keep their current value. With sampling or
+// coalescing every record carries the calls it stands for.
+int set_config(int mode, const char* syscalls, const char* capture, int sample_ratio, int max_rate,
+               int coalesce_usecs) {
+    const char* mode_str[] = {"OFF", "LOG", "BLOCK", "FSM", "LATENCY", "THROTTLE"};
+    struct sm_monitor_config cfg;
+    
+    if (ioctl(device_fd, IOCTL_GET_CONFIG, &cfg) < 0) {
+        perror("Failed to read config");
+        return -1;
+    }
+    
+    if (mode != -1) {
+        cfg.mode = mode;
+        cfg.flags |= SM_CONFIG_RESTART;
+    }
+    if (syscalls && parse_syscall_list(syscalls, &cfg.syscall_mask) < 0) return -1;
+    if (capture && parse_syscall_list(capture, &cfg.capture_mask) < 0) return -1;
+    if (sample_ratio != -1 || max_rate != -1) {
+        cfg.sampling.ratio = sample_ratio > 0 ? sample_ratio : 1;
+        cfg.sampling.max_rate = max_rate > 0 ? max_rate : 0;
+    }
+    if (coalesce_usecs != -1) cfg.coalesce_usecs = coalesce_usecs;
+    cfg.version = SM_CONFIG_VERSION;
+    
+    if (ioctl(device_fd, IOCTL_SET_CONFIG, &cfg) < 0) {
+        perror("Failed to set config");
+        return -1;
+    }
+    
+    printf("[INFO] Mode %s, syscalls 0x%x, capturing 0x%x, sampling 1 in %u calls, "
+           "at most %u events/s per CPU, coalescing %u us\n",
+           cfg.mode < SM_NR_MODES ? mode_str[cfg.mode] : "unknown", cfg.syscall_mask,
+           cfg.capture_mask, cfg.sampling.ratio, cfg.sampling.max_rate, cfg.coalesce_usecs);
+    return 0;
+}
+
+// Upload throttle buckets from "syscall=rate[/burst],..." where the burst
+// defaults to one second worth of calls
+int set_throttle(const char* spec, int deny) {
+    struct sm_throttle_config cfg;
+    char list[256];
+    char* saveptr = NULL;
+    
+    memset(&cfg, 0, sizeof(cfg));
+    snprintf(list, sizeof(list), "%s", spec);
+    for (char* tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        char* eq = strchr(tok, '=');
+        char* slash;
+        int syscall_type;
+        
+        if (!eq) {
+            printf("[ERROR] Invalid throttle %s (expected syscall=rate[/burst])\n", tok);
+            return -1;
+        }
+        *eq = '\0';
+        syscall_type = syscall_name_to_type(tok);
+        if (syscall_type < 0) {
+            printf("[ERROR] Invalid syscall name: %s\n", tok);
+            return -1;
+        }
+        cfg.rate[syscall_type] = strtoul(eq + 1, &slash, 10);
+        cfg.burst[syscall_type] = *slash == '/' ? strtoul(slash + 1, NULL, 10)
+                                                : cfg.rate[syscall_type];
+    }
+    cfg.flags = deny ? SM_THROTTLE_DENY : 0;
+    
+    if (ioctl(device_fd, IOCTL_SET_THROTTLE, &cfg) < 0) {
+        perror("Failed to set throttle");
+        return -1;
+    }
+    
+    printf("[INFO] Throttle set to: %s%s\n", spec, deny ? " (over-limit calls fail with EAGAIN)" : "");
+    return 0;
+}
+
+// Only log or block opens of paths under one of the comma separated
+// patterns, an empty list removes the filter
+int set_paths(const char* list) {
+    char buf[SM_PATHS_MAX_BYTES];
+    struct sm_path_filter filter = { 0 };
+    size_t len = strlen(list);
+    
+    if (len >= sizeof(buf)) {
+        printf("[ERROR] Path patterns longer than %d bytes\n", SM_PATHS_MAX_BYTES);
+        return -1;
+    }
+    
+    // the module takes the patterns NUL separated
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = list[i] == ',' ? '\0' : list[i];
+    }
+    filter.size = len;
+    filter.patterns = (__u64)(uintptr_t)buf;
+    
+    if (ioctl(device_fd, IOCTL_SET_PATHS, &filter) < 0) {
+        perror("Failed to set path filter");
+        return -1;
+    }
+    
+    printf("[INFO] openat path filter set to: %s\n", len ? list : "(none)");
+    return 0;
+}
+
+// Set PID
+int set_pid(int pid) {
+    if (ioctl(device_fd, IOCTL_SET_PID, &pid) < 0) {
+        perror("Failed to set PID");
+        return -1;
+    }
+    
+    printf("[INFO] Target PID set to: %d\n", pid);
+    return 0;
+}
+
+// Add or remove a comma separated list of pids/tgids
+int update_targets(unsigned long cmd, const char* what, char* list) {
+    char* saveptr = NULL;
+    
+    for (char* tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        int id = atoi(tok);
+        if (ioctl(device_fd, cmd, &id) < 0) {
+            printf("[ERROR] Failed to update %s %d: %s\n", what, id, strerror(errno));
+            return -1;
+        }
+        printf("[INFO] Target %s %s: %d\n", what,
+               (cmd == IOCTL_ADD_PID || cmd == IOCTL_ADD_TGID) ? "added" : "removed", id);
+    }
+    
+    return 0;
+}
+
+// A cgroup given as id or as path under the cgroup2 mount, whose
+// directory inode number is the id
+static int parse_cgroup(const char* name, __u64* id) {
+    if (name[0] == '/') {
+        struct stat st;
+        if (stat(name, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            printf("[ERROR] '%s' is not a cgroup directory\n", name);
+            return -1;
+        }
+        *id = st.st_ino;
+    } else {
+        *id = strtoull(name, NULL, 0);
+    }
+    return 0;
+}
+
+// Add or remove a comma separated list of cgroups
+int update_cgroups(unsigned long cmd, char* list, int descendants) {
+    char* saveptr = NULL;
+    
+    for (char* tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        struct sm_cgroup_target target = {0};
+        
+        if (parse_cgroup(tok, &target.id) < 0) return -1;
+        target.flags = descendants ? SM_CGROUP_DESCENDANTS : 0;
+        
+        if (ioctl(device_fd, cmd, &target) < 0) {
+            printf("[ERROR] Failed to update cgroup %s: %s\n", tok, strerror(errno));
+            return -1;
+        }
+        printf("[INFO] Target cgroup %s: %s (id %llu)%s\n",
+               cmd == IOCTL_ADD_CGROUP ? "added" : "removed", tok,
+               (unsigned long long)target.id, descendants ? " and descendants" : "");
+    }
+    
+    return 0;
+}
+
+// Give this open file its own rings and filter, leaving the global mode
+// and targets alone. Events then come only from the calls it asked for.
+int subscribe(const char* syscalls, const char* capture, int sample_ratio, int max_rate,
+              int coalesce_usecs, char* tgids, const char* cgroup) {
+    struct sm_subscription sub;
+    char* saveptr = NULL;
+    
+    memset(&sub, 0, sizeof(sub));
+    sub.config.version = SM_CONFIG_VERSION;
+    sub.config.mode = MODE_LOG;
+    sub.config.syscall_mask = (1U << SM_NR_SYSCALLS) - 1;
+    if (syscalls && parse_syscall_list(syscalls, &sub.config.syscall_mask) < 0) return -1;
+    if (capture && parse_syscall_list(capture, &sub.config.capture_mask) < 0) return -1;
+    sub.config.sampling.ratio = sample_ratio > 0 ? sample_ratio : 1;
+    sub.config.sampling.max_rate = max_rate > 0 ? max_rate : 0;
+    sub.config.coalesce_usecs = coalesce_usecs > 0 ? coalesce_usecs : 0;
+    if (cgroup && parse_cgroup(cgroup, &sub.cgroup_id) < 0) return -1;
+    
+    for (char* tok = tgids ? strtok_r(tgids, ",", &saveptr) : NULL; tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        if (sub.nr_tgids == SM_SUB_MAX_TGIDS) {
+            printf("[ERROR] A subscription takes at most %d processes\n", SM_SUB_MAX_TGIDS);
+            return -1;
+        }
+        sub.tgids[sub.nr_tgids++] = atoi(tok);
+    }
+    
+    if (ioctl(device_fd, IOCTL_SUBSCRIBE, &sub) < 0) {
+        perror("Failed to subscribe");
+        return -1;
+    }
+    
+    printf("[INFO] Subscribed to syscalls 0x%x of %s%s\n", sub.config.syscall_mask,
+           sub.nr_tgids ? "the given processes" : "every process",
+           sub.cgroup_id ? " in the given cgroup" : "");
+    return 0;
+}
+
+int set_follow(int on) {
+    __u32 follow = on;
+    
+    if (ioctl(device_fd, IOCTL_SET_FOLLOW, &follow) < 0) {
+        printf("[ERROR] Failed to set child following: %s\n", strerror(errno));
+        return -1;
+    }
+    printf("[INFO] Children of targets are %s\n", on ? "followed" : "no longer followed");
+    return 0;
+}
+
+int clear_targets() {
+    if (ioctl(device_fd, IOCTL_CLEAR_TARGETS) < 0) {
+        perror("Failed to clear targets");
+        return -1;
+    }
+    
+    printf("[INFO] Targets cleared, monitoring every process\n");
+    return 0;
+}
+
+// FSM compiler. Every JSON form ("states", "transitions" or "pattern")
+// becomes an NFA over the syscall alphabet, which subset construction
+// makes deterministic and partition refinement minimizes into the flat
+// [state][syscall] table that the kernel and --replay step through. A
+// transition back to the same state is stored as SM_FSM_NONE, so calls
+// that change nothing are not even probed.
+#define FSM_NFA_MAX 4096
+#define FSM_DFA_MAX 4096
+#define FSM_SET_WORDS (FSM_NFA_MAX / 64)
+#define FSM_REPEAT_MAX 64
+#define FSM_ALL_SYSCALLS ((1u << SM_NR_SYSCALLS) - 1)
+
+typedef struct {
+    int from;
+    int to;
+    __u32 mask;                         // syscalls on the edge, 0 for epsilon
+} NfaEdge;
+
+typedef struct {
+    uint64_t w[FSM_SET_WORDS];
+} NfaSet;
+
+typedef struct {
+    NfaEdge *edges;
+    int num_edges;
+    int cap_edges;
+    int num_states;
+    int start;
+    int stay;                           // no edge for a syscall keeps the state
+    NfaSet accept;
+} Nfa;
+
+static int nfa_state(Nfa* nfa) {
+    if (nfa->num_states == FSM_NFA_MAX) {
+        printf("[ERROR] FSM needs more than %d NFA states\n", FSM_NFA_MAX);
+        return -1;
+    }
+    return nfa->num_states++;
+}
+
+static int nfa_edge(Nfa* nfa, int from, int to, __u32 mask) {
+    if (nfa->num_edges == nfa->cap_edges) {
+        int cap = nfa->cap_edges ? nfa->cap_edges * 2 : 64;
+        NfaEdge *edges = realloc(nfa->edges, cap * sizeof(*edges));
+        
+        if (!edges) return -1;
+        nfa->edges = edges;
+        nfa->cap_edges = cap;
+    }
+    nfa->edges[nfa->num_edges++] = (NfaEdge){ .from = from, .to = to, .mask = mask };
+    return 0;
+}
+
+static inline void nfa_set_add(NfaSet *set, int q) {
+    set->w[q / 64] |= 1ULL << (q % 64);
+}
+
+static inline int nfa_set_has(const NfaSet *set, int q) {
+    return (set->w[q / 64] >> (q % 64)) & 1;
+}
+
+// Syscall patterns: names, '.' for any syscall, '!name' for any but one,
+// [a,b] and [^a,b] for sets, '|' and parentheses, and the postfix '*',
+// '+', '?', {n}, {n,} and {n,m}. Whitespace separates names.
+enum { PAT_SET, PAT_CAT, PAT_ALT, PAT_REPEAT };
+
+typedef struct PatNode {
+    int type;
+    __u32 mask;                         // PAT_SET
+    int min, max;                       // PAT_REPEAT, max -1 is unbounded
+    struct PatNode *left, *right;
+} PatNode;
+
+typedef struct {
+    const char *s;
+    const char *p;
+    int failed;
+} PatParser;
+
+static void pat_free(PatNode *n) {
+    if (!n) return;
+    pat_free(n->left);
+    pat_free(n->right);
+    free(n);
+}
+
+static PatNode *pat_node(int type, PatNode *left, PatNode *right) {
+    PatNode *n = calloc(1, sizeof(*n));
+    
+    if (!n) {
+        pat_free(left);
+        pat_free(right);
+        return NULL;
+    }
+    n->type = type;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+static PatNode *pat_error(PatParser *pp, const char *msg) {
+    if (!pp->failed) {
+        printf("[ERROR] Pattern \"%s\": %s at offset %d\n", pp->s, msg, (int)(pp->p - pp->s));
+    }
+    pp->failed = 1;
+    return NULL;
+}
+
+static void pat_skip(PatParser *pp) {
+    while (isspace((unsigned char)*pp->p)) pp->p++;
+}
+
+static int pat_name(PatParser *pp) {
+    char name[SM_TRACE_NAME_LEN];
+    size_t len = 0;
+    int type;
+    
+    pat_skip(pp);
+    while (isalpha((unsigned char)*pp->p)) {
+        if (len < sizeof(name) - 1) name[len++] = *pp->p;
+        pp->p++;
+    }
+    name[len] = '\0';
+    if (!len) {
+        pat_error(pp, "expected a syscall name");
+        return -1;
+    }
+    type = syscall_name_to_type(name);
+    if (type < 0) pat_error(pp, "unknown syscall");
+    return type;
+}
+
+static PatNode *pat_alt(PatParser *pp);
+
+static PatNode *pat_atom(PatParser *pp) {
+    __u32 mask = 0;
+    int negate = 0;
+    PatNode *n;
+    int type;
+    
+    pat_skip(pp);
+    if (*pp->p == '(') {
+        pp->p++;
+        n = pat_alt(pp);
+        if (n && *pp->p != ')') {
+            pat_free(n);
+            return pat_error(pp, "expected ')'");
+        }
+        pp->p++;
+        return n;
+    }
+    
+    if (*pp->p == '.') {
+        pp->p++;
+        mask = FSM_ALL_SYSCALLS;
+    } else if (*pp->p == '[') {
+        pp->p++;
+        pat_skip(pp);
+        if (*pp->p == '^') {
+            negate = 1;
+            pp->p++;
+        }
+        for (;;) {
+            if ((type = pat_name(pp)) < 0) return NULL;
+            mask |= 1u << type;
+            pat_skip(pp);
+            if (*pp->p != ',') break;
+            pp->p++;
+        }
+        if (*pp->p != ']') return pat_error(pp, "expected ']'");
+        pp->p++;
+    } else {
+        if (*pp->p == '!') {
+            negate = 1;
+            pp->p++;
+        }
+        if ((type = pat_name(pp)) < 0) return NULL;
+        mask = 1u << type;
+    }
+    if (negate) mask = FSM_ALL_SYSCALLS & ~mask;
+    // an empty mask would be an epsilon edge and match nothing at all
+    if (!mask) return pat_error(pp, "set matches no syscall");
+    
+    n = pat_node(PAT_SET, NULL, NULL);
+    if (n) n->mask = mask;
+    return n;
+}
+
+static PatNode *pat_postfix(PatParser *pp) {
+    PatNode *n = pat_atom(pp);
+    
+    while (n) {
+        int min, max;
+        
+        pat_skip(pp);
+        if (*pp->p == '*' || *pp->p == '+' || *pp->p == '?') {
+            min = *pp->p == '+';
+            max = *pp->p == '?' ? 1 : -1;
+            pp->p++;
+        } else if (*pp->p == '{') {
+            char *end;
+            
+            pp->p++;
+            min = max = strtol(pp->p, &end, 10);
+            if (end == pp->p) {
+                pat_free(n);
+                return pat_error(pp, "expected a repetition count");
+            }
+            pp->p = end;
+            if (*pp->p == ',') {
+                pp->p++;
+                max = -1;
+                if (isdigit((unsigned char)*pp->p)) {
+                    max = strtol(pp->p, &end, 10);
+                    pp->p = end;
+                }
+            }
+            if (*pp->p != '}' || min < 0 || min > FSM_REPEAT_MAX ||
+                (max != -1 && (max < min || max > FSM_REPEAT_MAX))) {
+                pat_free(n);
+                return pat_error(pp, "bad repetition count");
+            }
+            pp->p++;
+        } else {
+            return n;
+        }
+        
+        if (!(n = pat_node(PAT_REPEAT, n, NULL))) return NULL;
+        n->min = min;
+        n->max = max;
+    }
+    return NULL;
+}
+
+static PatNode *pat_cat(PatParser *pp) {
+    PatNode *n = NULL;
+    
+    for (;;) {
+        PatNode *r;
+        
+        pat_skip(pp);
+        if (!*pp->p || *pp->p == '|' || *pp->p == ')') break;
+        if (!(r = pat_postfix(pp))) {
+            pat_free(n);
+            return NULL;
+        }
+        n = n ? pat_node(PAT_CAT, n, r) : r;
+        if (!n) return NULL;
+    }
+    
+    return n ? n : pat_error(pp, "empty expression");
+}
+
+static PatNode *pat_alt(PatParser *pp) {
+    PatNode *n = pat_cat(pp);
+    
+    while (n && *pp->p == '|') {
+        PatNode *r;
+        
+        pp->p++;
+        if (!(r = pat_cat(pp))) {
+            pat_free(n);
+            return NULL;
+        }
+        n = pat_node(PAT_ALT, n, r);
+    }
+    return n;
+}
+
+static PatNode *pat_parse(const char* s) {
+    PatParser pp = { .s = s, .p = s };
+    PatNode *n = pat_alt(&pp);
+    
+    if (n && *pp.p) {
+        pat_free(n);
+        return pat_error(&pp, "unexpected character");
+    }
+    return n;
+}
+
+// The syscalls a single set expression such as "read|write" or "!close"
+// matches, -1 if it is more than a set
+static int pat_mask(const PatNode *n) {
+    int l, r;
+    
+    if (n->type == PAT_SET) return n->mask;
+    if (n->type != PAT_ALT) return -1;
+    l = pat_mask(n->left);
+    r = pat_mask(n->right);
+    return l < 0 || r < 0 ? -1 : l | r;
+}
+
+// Thompson construction: add the fragment of n, returning its ends
+static int nfa_build(Nfa* nfa, const PatNode *n, int *start, int *end) {
+    int s, e, a, b, c, d;
+    
+    switch (n->type) {
+        case PAT_SET:
+            if ((s = nfa_state(nfa)) < 0 || (e = nfa_state(nfa)) < 0 ||
+                nfa_edge(nfa, s, e, n->mask) < 0) {
+                return -1;
+            }
+            break;
+            
+        case PAT_CAT:
+            if (nfa_build(nfa, n->left, &s, &a) < 0 || nfa_build(nfa, n->right, &b, &e) < 0 ||
+                nfa_edge(nfa, a, b, 0) < 0) {
+                return -1;
+            }
+            break;
+            
+        case PAT_ALT:
+            if ((s = nfa_state(nfa)) < 0 || (e = nfa_state(nfa)) < 0 ||
+                nfa_build(nfa, n->left, &a, &b) < 0 || nfa_build(nfa, n->right, &c, &d) < 0 ||
+                nfa_edge(nfa, s, a, 0) < 0 || nfa_edge(nfa, s, c, 0) < 0 ||
+                nfa_edge(nfa, b, e, 0) < 0 || nfa_edge(nfa, d, e, 0) < 0) {
+                return -1;
+            }
+            break;
+            
+        case PAT_REPEAT:
+            // min copies in a row, then a loop or max - min optional copies
+            if ((s = e = nfa_state(nfa)) < 0) return -1;
+            for (int i = 0; i < n->min; i++) {
+                if (nfa_build(nfa, n->left, &a, &b) < 0 || nfa_edge(nfa, e, a, 0) < 0) return -1;
+                e = b;
+            }
+            for (int i = n->min; n->max < 0 ? i == n->min : i < n->max; i++) {
+                if (nfa_build(nfa, n->left, &a, &b) < 0 || (c = nfa_state(nfa)) < 0 ||
+                    nfa_edge(nfa, e, a, 0) < 0 || nfa_edge(nfa, e, c, 0) < 0 ||
+                    nfa_edge(nfa, b, c, 0) < 0 ||
+                    (n->max < 0 && nfa_edge(nfa, b, a, 0) < 0)) {
+                    return -1;
+                }
+                e = c;
+            }
+            break;
+            
+        default:
+            return -1;
+    }
+    
+    *start = s;
+    *end = e;
+    return 0;
+}
+
+// Expand set with everything reachable over epsilon edges
+static void nfa_closure(const Nfa* nfa, const int *first, NfaSet *set, int *stack) {
+    int top = 0;
+    
+    for (int q = 0; q < nfa->num_states; q++) {
+        if (nfa_set_has(set, q)) stack[top++] = q;
+    }
+    while (top) {
+        int q = stack[--top];
+        
+        for (int i = first[q]; i < first[q + 1]; i++) {
+            const NfaEdge *edge = &nfa->edges[i];
+            
+            if (!edge->mask && !nfa_set_has(set, edge->to)) {
+                nfa_set_add(set, edge->to);
+                stack[top++] = edge->to;
+            }
+        }
+    }
+}
+
+static uint64_t nfa_set_hash(const NfaSet *set) {
+    uint64_t h = 14695981039346656037ULL;
+    
+    for (int w = 0; w < FSM_SET_WORDS; w++) {
+        h = (h ^ set->w[w]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int edge_cmp(const void *a, const void *b) {
+    return ((const NfaEdge *)a)->from - ((const NfaEdge *)b)->from;
+}
+
+static int dfa_sig_cmp(const void *a, const void *b, void *ctx) {
+    const int *sig = ctx;
+    
+    return memcmp(&sig[*(const int *)a * (SM_NR_SYSCALLS + 1)],
+                  &sig[*(const int *)b * (SM_NR_SYSCALLS + 1)],
+                  (SM_NR_SYSCALLS + 1) * sizeof(int));
+}
+
+static int dfa_label_cmp(const void *a, const void *b, void *ctx) {
+    const uint64_t *label = ctx;
+    uint64_t x = label[*(const int *)a], y = label[*(const int *)b];
+    
+    return (x > y) - (x < y);
+}
+
+// Moore refinement: split states by label, then by the classes each
+// syscall leads to (-1 for no transition), until no class splits.
+// Returns the number of classes left in cls, -1 without memory.
+static int dfa_minimize(int num, int (*next)[SM_NR_SYSCALLS], const uint64_t *label, int *cls) {
+    int *order = malloc(num * sizeof(int));
+    int *sig = malloc(num * (SM_NR_SYSCALLS + 1) * sizeof(int));
+    int num_cls = -1;
+    
+    if (!order || !sig) goto out;
+    for (int d = 0; d < num; d++) {
+        order[d] = d;
+    }
+    qsort_r(order, num, sizeof(int), dfa_label_cmp, (void *)label);
+    num_cls = 0;
+    for (int i = 0; i < num; i++) {
+        if (i && label[order[i - 1]] != label[order[i]]) num_cls++;
+        cls[order[i]] = num_cls;
+    }
+    num_cls++;
+    for (;;) {
+        int count = 0;
+        
+        for (int d = 0; d < num; d++) {
+            int *s = &sig[d * (SM_NR_SYSCALLS + 1)];
+            
+            s[0] = cls[d];
+            for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+                s[c + 1] = next[d][c] < 0 ? -1 : cls[next[d][c]];
+            }
+            order[d] = d;
+        }
+        qsort_r(order, num, sizeof(int), dfa_sig_cmp, sig);
+        for (int i = 0; i < num; i++) {
+            if (i && dfa_sig_cmp(&order[i - 1], &order[i], sig) != 0) count++;
+            cls[order[i]] = count;
+        }
+        if (count + 1 == num_cls) break;
+        num_cls = count + 1;
+    }
+    
+out:
+    free(order);
+    free(sig);
+    return num_cls;
+}
+
+// Determinize and minimize nfa into table (scope is left to the caller)
+static int nfa_compile(Nfa* nfa, struct sm_fsm_table* table) {
+    int hash_size = FSM_DFA_MAX * 2;
+    NfaSet *sets = malloc(FSM_DFA_MAX * sizeof(*sets));
+    int (*next)[SM_NR_SYSCALLS] = malloc(FSM_DFA_MAX * sizeof(*next));
+    int *first = calloc(nfa->num_states + 1, sizeof(int));
+    int *stack = malloc(nfa->num_states * sizeof(int));
+    int *hash = malloc(hash_size * sizeof(int));
+    int *cls = NULL, *renum = NULL;
+    uint64_t *label = NULL;
+    int num_dfa = 0, num_cls, ret = -1;
+    
+    if (!sets || !next || !first || !stack || !hash) goto out;
+    memset(hash, -1, hash_size * sizeof(int));
+    
+    // Index edges by source state
+    qsort(nfa->edges, nfa->num_edges, sizeof(NfaEdge), edge_cmp);
+    for (int i = 0; i < nfa->num_edges; i++) {
+        first[nfa->edges[i].from + 1]++;
+    }
+    for (int q = 0; q < nfa->num_states; q++) {
+        first[q + 1] += first[q];
+    }
+    
+    // Subset construction, DFA states are numbered in discovery order
+    memset(&sets[0], 0, sizeof(NfaSet));
+    nfa_set_add(&sets[0], nfa->start);
+    nfa_closure(nfa, first, &sets[0], stack);
+    hash[nfa_set_hash(&sets[0]) % hash_size] = 0;
+    for (int d = 0, pending = 1; d < pending; d++) {
+        for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+            NfaSet set;
+            int slot;
+            
+            memset(&set, 0, sizeof(set));
+            for (int q = 0; q < nfa->num_states; q++) {
+                int moved = 0;
+                
+                if (!nfa_set_has(&sets[d], q)) continue;
+                for (int i = first[q]; i < first[q + 1]; i++) {
+                    if (nfa->edges[i].mask & (1u << c)) {
+                        nfa_set_add(&set, nfa->edges[i].to);
+                        moved = 1;
+                    }
+                }
+                if (!moved && nfa->stay) nfa_set_add(&set, q);
+            }
+            nfa_closure(nfa, first, &set, stack);
+            
+            for (slot = nfa_set_hash(&set) % hash_size; hash[slot] >= 0; slot = (slot + 1) % hash_size) {
+                if (memcmp(&sets[hash[slot]], &set, sizeof(set)) == 0) break;
+            }
+            if (hash[slot] < 0) {
+                if (pending == FSM_DFA_MAX) {
+                    printf("[ERROR] FSM needs more than %d DFA states\n", FSM_DFA_MAX);
+                    goto out;
+                }
+                sets[pending] = set;
+                hash[slot] = pending++;
+            }
+            next[d][c] = hash[slot];
+        }
+        num_dfa = pending;
+    }
+    
+    // Minimize with accepting as the label
+    cls = malloc(num_dfa * sizeof(int));
+    label = malloc(num_dfa * sizeof(uint64_t));
+    renum = malloc(num_dfa * sizeof(int));
+    if (!cls || !label || !renum) goto out;
+    for (int d = 0; d < num_dfa; d++) {
+        int accepting = 0;
+        
+        for (int w = 0; w < FSM_SET_WORDS; w++) {
+            accepting |= (sets[d].w[w] & nfa->accept.w[w]) != 0;
+        }
+        label[d] = accepting;
+    }
+    if ((num_cls = dfa_minimize(num_dfa, next, label, cls)) < 0) goto out;
+    
+    if (num_cls > SM_FSM_MAX_STATES) {
+        printf("[ERROR] FSM has %d states after minimization, the module supports %d\n",
+               num_cls, SM_FSM_MAX_STATES);
+        goto out;
+    }
+    
+    // Number classes in DFA discovery order, so the start state is 0
+    memset(renum, -1, num_dfa * sizeof(int));
+    memset(table, 0, sizeof(*table));
+    memset(table->next, SM_FSM_NONE, sizeof(table->next));
+    for (int d = 0; d < num_dfa; d++) {
+        if (renum[cls[d]] < 0) renum[cls[d]] = table->num_states++;
+    }
+    for (int d = 0; d < num_dfa; d++) {
+        if (label[d]) table->accept_mask |= 1ULL << renum[cls[d]];
+    }
+    // A pattern that matches again without leaving an accepting state
+    // still has to report it, only a stay is free
+    for (int d = 0; d < num_dfa; d++) {
+        int s = renum[cls[d]];
+        
+        for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+            int t = renum[cls[next[d][c]]];
+            
+            if (t != s || (!nfa->stay && (table->accept_mask & (1ULL << s)))) {
+                table->next[s][c] = t;
+            }
+        }
+    }
+    table->start_state = 0;
+    printf("[FSM] Compiled %d NFA states into %d DFA states, %u after minimization\n",
+           nfa->num_states, num_dfa, table->num_states);
+    ret = 0;
+    
+out:
+    free(sets);
+    free(next);
+    free(first);
+    free(stack);
+    free(hash);
+    free(cls);
+    free(label);
+    free(renum);
+    return ret;
+}
+
+// Rule sets. Every rule compiles to its own table, then rules are merged
+// into product automata that step all of them with one load per
+// syscall. A product state remembers the rules its last transition
+// completed, so accept[state] names them exactly. If a product grows past
+// FSM_PRODUCT_MAX states the next rule starts another automaton instead,
+// and the kernel steps up to SM_FSM_MAX_AUTOMATA of them side by side.
+#define FSM_MAX_RULES 64
+#define FSM_PRODUCT_MAX (SM_FSM_SET_MAX_STATES / SM_FSM_MAX_AUTOMATA)
+
+typedef struct {
+    int num_states;                     // the start state is 0
+    int (*next)[SM_NR_SYSCALLS];        // -1 if the syscall is ignored
+    uint64_t *accept;                   // rules that accept on entering a state
+} Automaton;
+
+typedef struct {
+    int a;
+    int b;
+    uint64_t fired;                     // rules completed by entering the state
+} ProductState;
+
+static void automaton_free(Automaton* m) {
+    free(m->next);
+    free(m->accept);
+    memset(m, 0, sizeof(*m));
+}
+
+// One rule as an automaton, accepting states fire bit rule
+static int automaton_from_table(const struct sm_fsm_table* table, int rule, Automaton* m) {
+    m->num_states = table->num_states;
+    m->next = malloc(m->num_states * sizeof(*m->next));
+    m->accept = malloc(m->num_states * sizeof(uint64_t));
+    if (!m->next || !m->accept) {
+        automaton_free(m);
+        return -1;
+    }
+    for (int s = 0; s < m->num_states; s++) {
+        m->accept[s] = (table->accept_mask >> s) & 1 ? 1ULL << rule : 0;
+        for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+            m->next[s][c] = table->next[s][c] == SM_FSM_NONE ? -1 : table->next[s][c];
+        }
+    }
+    return 0;
+}
+
+static uint64_t product_hash(const ProductState *p) {
+    return ((uint64_t)p->a * 0x9e3779b97f4a7c15ULL ^ (uint64_t)p->b * 0xc2b2ae3d27d4eb4fULL ^
+            p->fired) * 1099511628211ULL;
+}
+
+// Minimal automaton stepping x and y together. A syscall neither of them
+// takes is ignored, and a transition back to the same state is only kept
+// if it completes rules. Returns 1 if the reachable product has more than
+// max states, -1 without memory.
+static int automaton_product(const Automaton* x, const Automaton* y, int max, Automaton* out) {
+    int hash_size = max * 2;
+    ProductState *states = malloc(max * sizeof(*states));
+    int (*next)[SM_NR_SYSCALLS] = malloc(max * sizeof(*next));
+    uint64_t *label = malloc(max * sizeof(uint64_t));
+    int *hash = malloc(hash_size * sizeof(int));
+    int *cls = malloc(max * sizeof(int));
+    int *renum = malloc(max * sizeof(int));
+    int num = 1, num_cls, ret = -1;
+    
+    memset(out, 0, sizeof(*out));
+    if (!states || !next || !label || !hash || !cls || !renum) goto out;
+    memset(hash, -1, hash_size * sizeof(int));
+    
+    memset(&states[0], 0, sizeof(states[0]));
+    hash[product_hash(&states[0]) % hash_size] = 0;
+    for (int d = 0; d < num; d++) {
+        label[d] = states[d].fired;
+        for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+            int na = x->next[states[d].a][c], nb = y->next[states[d].b][c];
+            ProductState t;
+            int slot;
+            
+            if (na < 0 && nb < 0) {
+                next[d][c] = -1;
+                continue;
+            }
+            t.a = na < 0 ? states[d].a : na;
+            t.b = nb < 0 ? states[d].b : nb;
+            t.fired = (na < 0 ? 0 : x->accept[na]) | (nb < 0 ? 0 : y->accept[nb]);
+            
+            for (slot = product_hash(&t) % hash_size; hash[slot] >= 0; slot = (slot + 1) % hash_size) {
+                const ProductState *p = &states[hash[slot]];
+                
+                if (p->a == t.a && p->b == t.b && p->fired == t.fired) break;
+            }
+            if (hash[slot] < 0) {
+                if (num == max) {
+                    ret = 1;
+                    goto out;
+                }
+                states[num] = t;
+                hash[slot] = num++;
+            }
+            next[d][c] = hash[slot];
+        }
+    }
+    
+    if ((num_cls = dfa_minimize(num, next, label, cls)) < 0) goto out;
+    out->next = malloc(num_cls * sizeof(*out->next));
+    out->accept = malloc(num_cls * sizeof(uint64_t));
+    if (!out->next || !out->accept) goto out;
+    
+    // Number classes in discovery order, so the start state stays 0
+    memset(renum, -1, num * sizeof(int));
+    for (int d = 0; d < num; d++) {
+        if (renum[cls[d]] < 0) renum[cls[d]] = out->num_states++;
+    }
+    for (int d = 0; d < num; d++) {
+        int s = renum[cls[d]];
+        
+        out->accept[s] = label[d];
+        for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+            int t = next[d][c] < 0 ? -1 : renum[cls[next[d][c]]];
+            
+            out->next[s][c] = t == s && !label[d] ? -1 : t;
+        }
+    }
+    ret = 0;
+    
+out:
+    if (ret != 0) automaton_free(out);
+    free(states);
+    free(next);
+    free(label);
+    free(hash);
+    free(cls);
+    free(renum);
+    return ret;
 }
 
-void close_device() {
-    if (device_fd >= 0) {
-        close(device_fd);
-        device_fd = -1;
+// Named states of the "transitions" form
+#define FSM_NAMED_MAX 256
+
+static int fsm_state_index(const char** names, int* count, const char* name) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(names[i], name) == 0) return i;
+    }
+    if (*count == FSM_NAMED_MAX) {
+        printf("[ERROR] FSM has more than %d states\n", FSM_NAMED_MAX);
+        return -1;
     }
+    names[*count] = name;
+    return (*count)++;
 }
 
-// Set mode via ioctl
-int set_mode(int mode) {
-    const char* mode_str[] = {"OFF", "LOG", "BLOCK"};
+// "states": a cycle of syscalls that accepts when it completes
+static int load_states(Nfa* nfa, cJSON* states_json) {
+    int num_states = cJSON_GetArraySize(states_json);
     
-    if (ioctl(device_fd, IOCTL_SET_MODE, &mode) < 0) {
-        perror("Failed to set mode");
+    if (num_states == 0) {
+        printf("[ERROR] FSM must have at least one state\n");
+        return -1;
+    }
+    if (num_states > FSM_NAMED_MAX) {
+        printf("[ERROR] FSM has more than %d states\n", FSM_NAMED_MAX);
         return -1;
     }
     
-    printf("[INFO] Mode changed to: %s\n", mode_str[mode]);
+    nfa->stay = 1;
+    nfa->num_states = num_states;
+    nfa->start = 0;
+    nfa_set_add(&nfa->accept, 0);
+    printf("[FSM] Loaded FSM with %d states: ", num_states);
+    for (int i = 0; i < num_states; i++) {
+        cJSON* state = cJSON_GetArrayItem(states_json, i);
+        const char* state_name = cJSON_IsString(state) ? cJSON_GetStringValue(state) : NULL;
+        int type = state_name ? syscall_name_to_type(state_name) : -1;
+        
+        if (type < 0) {
+            printf("\n[ERROR] State %d is not a syscall name\n", i);
+            return -1;
+        }
+        if (nfa_edge(nfa, i, (i + 1) % num_states, 1u << type) < 0) return -1;
+        printf("%s%s", state_name, i < num_states - 1 ? " -> " : "");
+    }
+    printf(" (loops back)\n");
+    
     return 0;
 }
 
-// Convert syscall name to type
-int syscall_name_to_type(const char* name) {
-    if (strcmp(name, "open") == 0) return SYSCALL_OPEN;
-    if (strcmp(name, "read") == 0) return SYSCALL_READ;
-    if (strcmp(name, "write") == 0) return SYSCALL_WRITE;
-    return -1;
-}
-
-// Convert syscall type to name
-const char* syscall_type_to_name(int type) {
-    switch(type) {
-        case SYSCALL_OPEN: return "open";
-        case SYSCALL_READ: return "read";
-        case SYSCALL_WRITE: return "write";
-        default: return "unknown";
+// "transitions": explicit edges between named states, a call without
+// an edge leaves the state alone
+static int load_transitions(Nfa* nfa, cJSON* json, cJSON* transitions) {
+    const char* names[FSM_NAMED_MAX];
+    cJSON* start = cJSON_GetObjectItem(json, "start");
+    cJSON* accept = cJSON_GetObjectItem(json, "accept");
+    int num_transitions = cJSON_GetArraySize(transitions);
+    int count = 0;
+    cJSON* item;
+    
+    nfa->stay = 1;
+    
+    // Name states in order of appearance, the start state first
+    if (start && (!cJSON_IsString(start) ||
+                  fsm_state_index(names, &count, cJSON_GetStringValue(start)) < 0)) {
+        printf("[ERROR] 'start' must be a state name\n");
+        return -1;
     }
-}
-
-// Set syscall to monitor
-int set_syscall(const char* syscall_name) {
-    int syscall_type = syscall_name_to_type(syscall_name);
+    for (int i = 0; i < num_transitions; i++) {
+        cJSON* t = cJSON_GetArrayItem(transitions, i);
+        cJSON* from = cJSON_GetObjectItem(t, "from");
+        cJSON* on = cJSON_GetObjectItem(t, "on");
+        cJSON* to = cJSON_GetObjectItem(t, "to");
+        
+        if (!cJSON_IsString(from) || !cJSON_IsString(on) || !cJSON_IsString(to)) {
+            printf("[ERROR] Transition %d needs string 'from', 'on' and 'to'\n", i);
+            return -1;
+        }
+        if ((strcmp(cJSON_GetStringValue(from), "*") != 0 &&
+             fsm_state_index(names, &count, cJSON_GetStringValue(from)) < 0) ||
+            fsm_state_index(names, &count, cJSON_GetStringValue(to)) < 0) {
+            return -1;
+        }
+    }
+    if (count == 0) {
+        printf("[ERROR] FSM must have at least one state\n");
+        return -1;
+    }
+    nfa->num_states = count;
+    nfa->start = 0;
     
-    if (syscall_type < 0) {
-        printf("[ERROR] Invalid syscall name: %s (must be: open, read, or write)\n", syscall_name);
+    for (int i = 0; i < num_transitions; i++) {
+        cJSON* t = cJSON_GetArrayItem(transitions, i);
+        const char* from = cJSON_GetStringValue(cJSON_GetObjectItem(t, "from"));
+        const char* on = cJSON_GetStringValue(cJSON_GetObjectItem(t, "on"));
+        int to = fsm_state_index(names, &count, cJSON_GetStringValue(cJSON_GetObjectItem(t, "to")));
+        PatNode *set = pat_parse(on);
+        int mask = set ? pat_mask(set) : -1;
+        
+        pat_free(set);
+        if (mask <= 0) {
+            if (set) printf("[ERROR] Transition %d: 'on' must be a syscall set such as "
+                            "\"read|write\", \"!close\" or \".\"\n", i);
+            return -1;
+        }
+        for (int q = 0; q < count; q++) {
+            if ((strcmp(from, "*") == 0 || strcmp(from, names[q]) == 0) &&
+                nfa_edge(nfa, q, to, mask) < 0) {
+                return -1;
+            }
+        }
+    }
+    
+    if (!cJSON_IsArray(accept) || cJSON_GetArraySize(accept) == 0) {
+        printf("[ERROR] 'accept' must be an array of state names\n");
         return -1;
     }
+    cJSON_ArrayForEach(item, accept) {
+        int q;
+        
+        for (q = 0; q < count; q++) {
+            if (cJSON_IsString(item) && strcmp(cJSON_GetStringValue(item), names[q]) == 0) break;
+        }
+        if (q == count) {
+            printf("[ERROR] Accepting state %s has no transitions\n",
+                   cJSON_IsString(item) ? cJSON_GetStringValue(item) : "(not a string)");
+            return -1;
+        }
+        nfa_set_add(&nfa->accept, q);
+    }
+    
+    printf("[FSM] Loaded FSM with %d states and %d transitions, starting in %s\n",
+           count, num_transitions, names[0]);
+    return 0;
+}
+
+// "pattern": accepts whenever the syscalls seen so far end with a match,
+// an implicit leading ".*" keeps looking after every call
+static int load_pattern(Nfa* nfa, const char* pattern) {
+    PatNode *root = pat_parse(pattern);
+    int s, a, b;
+    
+    if (!root) return -1;
     
-    if (ioctl(device_fd, IOCTL_SET_SYSCALL, &syscall_type) < 0) {
-        perror("Failed to set syscall");
+    nfa->stay = 0;
+    if ((s = nfa_state(nfa)) < 0 || nfa_edge(nfa, s, s, FSM_ALL_SYSCALLS) < 0 ||
+        nfa_build(nfa, root, &a, &b) < 0 || nfa_edge(nfa, s, a, 0) < 0) {
+        pat_free(root);
         return -1;
     }
+    pat_free(root);
+    nfa->start = s;
+    nfa_set_add(&nfa->accept, b);
     
-    printf("[INFO] Target syscall set to: %s\n", syscall_name);
+    printf("[FSM] Loaded pattern: %s\n", pattern);
     return 0;
 }
 
-// Set PID
-int set_pid(int pid) {
-    if (ioctl(device_fd, IOCTL_SET_PID, &pid) < 0) {
-        perror("Failed to set PID");
+// Compile one rule object into table and return its scope, -1 on error.
+// The rule is one of:
+//   "states": ["open", "read", "write"]
+//   "transitions": [{"from": "idle", "on": "open", "to": "opened"}, ...]
+//       with "accept" state names and an optional "start" (default the
+//       first state named), "from": "*" for every state and "on" a set
+//       such as "read|write", "[read,write]", "!close" or "."
+//   "pattern": "open (read|write){3,} !close* connect"
+// and an optional "scope": "global", "tgid" (per process) or "pid" (per
+// thread). Timing between states cannot be expressed, cursors in the
+// kernel carry no timestamp.
+static int compile_rule(cJSON* json, struct sm_fsm_table* table) {
+    int scope = SM_FSM_GLOBAL;
+    cJSON* scope_json = cJSON_GetObjectItem(json, "scope");
+    if (scope_json) {
+        const char* name = cJSON_IsString(scope_json) ? cJSON_GetStringValue(scope_json) : "";
+        if (strcmp(name, "global") == 0) scope = SM_FSM_GLOBAL;
+        else if (strcmp(name, "tgid") == 0) scope = SM_FSM_PER_TGID;
+        else if (strcmp(name, "pid") == 0) scope = SM_FSM_PER_PID;
+        else {
+            printf("[ERROR] 'scope' must be \"global\", \"tgid\" or \"pid\"\n");
+            return -1;
+        }
+    }
+    
+    cJSON* pattern = cJSON_GetObjectItem(json, "pattern");
+    cJSON* transitions = cJSON_GetObjectItem(json, "transitions");
+    cJSON* states = cJSON_GetObjectItem(json, "states");
+    Nfa* nfa = calloc(1, sizeof(Nfa));
+    int ret = -1;
+    
+    if (!nfa) {
+        printf("[ERROR] Out of memory\n");
+    } else if (pattern) {
+        if (cJSON_IsString(pattern)) ret = load_pattern(nfa, cJSON_GetStringValue(pattern));
+        else printf("[ERROR] 'pattern' must be a string\n");
+    } else if (transitions) {
+        if (cJSON_IsArray(transitions)) ret = load_transitions(nfa, json, transitions);
+        else printf("[ERROR] 'transitions' must be an array\n");
+    } else if (states) {
+        if (cJSON_IsArray(states)) ret = load_states(nfa, states);
+        else printf("[ERROR] 'states' must be an array\n");
+    } else {
+        printf("[ERROR] FSM needs 'states', 'transitions' or 'pattern'\n");
+    }
+    if (ret == 0) {
+        ret = nfa_compile(nfa, table);
+    }
+    
+    if (nfa) free(nfa->edges);
+    free(nfa);
+    if (ret < 0) {
         return -1;
     }
+    table->scope = scope;
+    return scope;
+}
+
+// Rules collected by load_fsm() before they are merged
+typedef struct {
+    struct sm_fsm_table tables[FSM_MAX_RULES];
+    char *names[FSM_MAX_RULES];
+    int count;
+    int scope;                          // -1 before the first rule
+} FsmRules;
+
+static int add_rule(FsmRules* rules, cJSON* json, const char* name) {
+    int scope;
     
-    printf("[INFO] Target PID set to: %d\n", pid);
+    if (rules->count == FSM_MAX_RULES) {
+        printf("[ERROR] More than %d FSM rules\n", FSM_MAX_RULES);
+        return -1;
+    }
+    printf("[FSM] Rule %s\n", name);
+    if ((scope = compile_rule(json, &rules->tables[rules->count])) < 0) {
+        return -1;
+    }
+    // Cursors are keyed once per event, for every automaton alike
+    if (rules->scope >= 0 && scope != rules->scope) {
+        printf("[ERROR] Rule %s has a different 'scope', all rules must share one\n", name);
+        return -1;
+    }
+    if (!(rules->names[rules->count] = strdup(name))) {
+        printf("[ERROR] Out of memory\n");
+        return -1;
+    }
+    rules->scope = scope;
+    rules->count++;
     return 0;
 }
 
-// Load FSM from jSON file
-FSM* load_fsm(const char* filename) {
-    FILE* fp = fopen(filename, "r");
+// A file holds one rule named after the file, or several as
+// "rules": [{"name": "...", "pattern": ...}, ...]
+static int load_rule_file(FsmRules* rules, const char* path) {
+    FILE* fp = fopen(path, "r");
     if (!fp) {
         perror("Failed to open FSM file");
-        return NULL;
+        return -1;
     }
     
     fseek(fp, 0, SEEK_END);
@@ -146,116 +2559,475 @@ FSM* load_fsm(const char* filename) {
     free(content);
     
     if (!json) {
-        printf("[ERROR] Failed to parse JSON: %s\n", cJSON_GetErrorPtr());
-        return NULL;
+        printf("[ERROR] Failed to parse JSON in %s: %s\n", path, cJSON_GetErrorPtr());
+        return -1;
     }
     
-    cJSON* states_json = cJSON_GetObjectItem(json, "states");
-    if (!cJSON_IsArray(states_json)) {
-        printf("[ERROR] 'states' must be an array\n");
-        cJSON_Delete(json);
-        return NULL;
+    const char* base = strrchr(path, '/');
+    char name[SM_PATH_MAX];
+    size_t len;
+    
+    snprintf(name, sizeof(name), "%s", base ? base + 1 : path);
+    len = strlen(name);
+    if (len > 5 && strcmp(name + len - 5, ".json") == 0) name[len - 5] = '\0';
+    
+    cJSON* list = cJSON_GetObjectItem(json, "rules");
+    int ret = 0;
+    
+    if (!list) {
+        ret = add_rule(rules, json, name);
+    } else if (!cJSON_IsArray(list)) {
+        printf("[ERROR] 'rules' must be an array of FSM objects\n");
+        ret = -1;
+    } else {
+        for (int i = 0; i < cJSON_GetArraySize(list) && ret == 0; i++) {
+            cJSON* rule = cJSON_GetArrayItem(list, i);
+            cJSON* rule_name = cJSON_GetObjectItem(rule, "name");
+            char label[SM_PATH_MAX + 16];
+            
+            if (cJSON_IsString(rule_name)) {
+                snprintf(label, sizeof(label), "%s", cJSON_GetStringValue(rule_name));
+            } else {
+                snprintf(label, sizeof(label), "%s[%d]", name, i);
+            }
+            ret = add_rule(rules, rule, label);
+        }
     }
     
-    int num_states = cJSON_GetArraySize(states_json);
-    if (num_states == 0) {
-        printf("[ERROR] FSM must have at least one state\n");
-        cJSON_Delete(json);
-        return NULL;
+    cJSON_Delete(json);
+    return ret;
+}
+
+static int is_json_file(const struct dirent *d) {
+    size_t len = strlen(d->d_name);
+    
+    return len > 5 && strcmp(d->d_name + len - 5, ".json") == 0;
+}
+
+// Every *.json in dir, in name order so rule numbers are stable
+static int load_rule_dir(FsmRules* rules, const char* dir) {
+    struct dirent **list;
+    int n = scandir(dir, &list, is_json_file, alphasort);
+    int ret = 0;
+    
+    if (n < 0) {
+        perror("Failed to read FSM directory");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        char path[SM_PATH_MAX * 2];
+        
+        snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+        if (ret == 0) ret = load_rule_file(rules, path);
+        free(list[i]);
+    }
+    free(list);
+    return ret;
+}
+
+// Merge rules greedily, each into the last automaton unless the product
+// outgrows the guard, then number the states of all automata together
+static FSM* merge_rules(FsmRules* rules) {
+    Automaton groups[SM_FSM_MAX_AUTOMATA];
+    int num_groups = 0, err = -1;
+    FSM* fsm = NULL;
+    
+    memset(groups, 0, sizeof(groups));
+    for (int r = 0; r < rules->count; r++) {
+        Automaton rule, merged;
+        
+        if (automaton_from_table(&rules->tables[r], r, &rule) < 0) goto out;
+        if (num_groups > 0) {
+            err = automaton_product(&groups[num_groups - 1], &rule, FSM_PRODUCT_MAX, &merged);
+            if (err == 0) {
+                automaton_free(&groups[num_groups - 1]);
+                automaton_free(&rule);
+                groups[num_groups - 1] = merged;
+                continue;
+            }
+            if (err < 0 || num_groups == SM_FSM_MAX_AUTOMATA) {
+                automaton_free(&rule);
+                goto out;
+            }
+            printf("[FSM] Rule %s would grow automaton %d past %d states, starting automaton %d\n",
+                   rules->names[r], num_groups, FSM_PRODUCT_MAX, num_groups + 1);
+        }
+        groups[num_groups++] = rule;
     }
     
-    FSM* fsm = malloc(sizeof(FSM));
-    fsm->num_states = num_states;
-    fsm->current_state = 0;
-    fsm->states = malloc(sizeof(char*) * num_states);
+    fsm = calloc(1, sizeof(FSM));
+    if (!fsm) goto out;
+    for (int g = 0; g < num_groups; g++) {
+        fsm->num_states += groups[g].num_states;
+    }
+    fsm->next = malloc(fsm->num_states * sizeof(*fsm->next));
+    fsm->accept = malloc(fsm->num_states * sizeof(uint64_t));
+    fsm->rule_names = calloc(FSM_MAX_RULES, sizeof(char *));
+    if (!fsm->next || !fsm->accept || !fsm->rule_names) goto out;
     
-    for (int i = 0; i < num_states; i++) {
-        cJSON* state = cJSON_GetArrayItem(states_json, i);
-        if (!cJSON_IsString(state)) {
-            printf("[ERROR] State %d is not a string\n", i);
-            free_fsm(fsm);
-            cJSON_Delete(json);
-            return NULL;
+    for (int g = 0, base = 0; g < num_groups; base += groups[g++].num_states) {
+        fsm->start[g] = base;
+        for (int s = 0; s < groups[g].num_states; s++) {
+            fsm->accept[base + s] = groups[g].accept[s];
+            for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+                int t = groups[g].next[s][c];
+                
+                fsm->next[base + s][c] = t < 0 ? SM_FSM_SET_NONE : base + t;
+            }
         }
-        
-        const char* state_name = cJSON_GetStringValue(state);
-        if (syscall_name_to_type(state_name) < 0) {
-            printf("[ERROR] Invalid syscall in state %d: %s\n", i, state_name);
-            free_fsm(fsm);
-            cJSON_Delete(json);
-            return NULL;
+    }
+    fsm->num_automata = num_groups;
+    fsm->scope = rules->scope;
+    fsm->num_rules = rules->count;
+    memcpy(fsm->rule_names, rules->names, rules->count * sizeof(char *));
+    memset(rules->names, 0, sizeof(rules->names));
+    err = 0;
+    
+    if (fsm->num_rules > 1) {
+        printf("[FSM] Merged %d rules into %d automata with %d states\n",
+               fsm->num_rules, fsm->num_automata, fsm->num_states);
+    }
+    
+out:
+    if (err != 0) {
+        if (err > 0) {
+            printf("[ERROR] Rules need more than %d automata of up to %d states\n",
+                   SM_FSM_MAX_AUTOMATA, FSM_PRODUCT_MAX);
+        } else {
+            printf("[ERROR] Out of memory\n");
         }
-        
-        fsm->states[i] = strdup(state_name);
+        free_fsm(fsm);
+        fsm = NULL;
+    }
+    for (int g = 0; g < num_groups; g++) {
+        automaton_free(&groups[g]);
     }
+    return fsm;
+}
+
+// Load FSM rules from JSON files and directories of them (see
+// compile_rule() for the format) and merge them for the kernel
+FSM* load_fsm(char** paths, int num_paths) {
+    FsmRules* rules = calloc(1, sizeof(FsmRules));
+    FSM* fsm = NULL;
+    int ret = 0;
     
-    cJSON_Delete(json);
+    if (!rules) {
+        printf("[ERROR] Out of memory\n");
+        return NULL;
+    }
+    rules->scope = -1;
     
-    printf("[FSM] Loaded FSM with %d states: ", num_states);
-    for (int i = 0; i < num_states; i++) {
-        printf("%s", fsm->states[i]);
-        if (i < num_states - 1) printf(" -> ");
+    for (int i = 0; i < num_paths && ret == 0; i++) {
+        struct stat st;
+        
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) ret = load_rule_dir(rules, paths[i]);
+        else ret = load_rule_file(rules, paths[i]);
+    }
+    if (ret == 0 && rules->count == 0) {
+        printf("[ERROR] No FSM rules found\n");
+        ret = -1;
+    }
+    if (ret == 0) {
+        fsm = merge_rules(rules);
+    }
+    if (fsm && fsm->scope != SM_FSM_GLOBAL) {
+        printf("[FSM] One FSM per %s\n", fsm->scope == SM_FSM_PER_TGID ? "process" : "thread");
     }
-    printf(" (loops back)\n");
     
+    for (int i = 0; i < rules->count; i++) {
+        free(rules->names[i]);
+    }
+    free(rules);
     return fsm;
 }
 
 void free_fsm(FSM* fsm) {
     if (!fsm) return;
-    
-    for (int i = 0; i < fsm->num_states; i++) {
-        free(fsm->states[i]);
+    for (int r = 0; fsm->rule_names && r < fsm->num_rules; r++) {
+        free(fsm->rule_names[r]);
     }
-    free(fsm->states);
+    free(fsm->rule_names);
+    free(fsm->next);
+    free(fsm->accept);
     free(fsm);
 }
 
-// observed syscall
-int check_syscall_observed(const char* syscall_name) {
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), 
-             "sudo dmesg | tail -20 | grep -q 'SYSCALL_MONITOR.*called %s'", 
-             syscall_name);
+// Names of the syscalls that move some automaton on from its start state
+static void fsm_expected(const FSM* fsm, char* buf, size_t len) {
+    size_t used = 0;
+    
+    buf[0] = '\0';
+    for (int c = 0; c < SM_NR_SYSCALLS && used < len; c++) {
+        int i;
+        
+        for (i = 0; i < fsm->num_automata; i++) {
+            if (fsm->next[fsm->start[i]][c] != SM_FSM_SET_NONE) break;
+        }
+        if (i == fsm->num_automata) continue;
+        used += snprintf(buf + used, len - used, "%s%s()", used ? " or " : "",
+                         syscall_type_to_name(c));
+    }
+}
+
+// Print the names of the rules in a bitmap
+static void print_rules(const FSM* fsm, uint64_t rules) {
+    const char* sep = "";
+    
+    for (int r = 0; r < fsm->num_rules; r++) {
+        if (!(rules & (1ULL << r))) continue;
+        printf("%s%s", sep, fsm->rule_names[r]);
+        sep = ", ";
+    }
+}
+
+// Upload the FSM into the kernel engine
+int upload_fsm(FSM* fsm) {
+    struct sm_fsm_set set;
+    
+    memset(&set, 0, sizeof(set));
+    set.num_states = fsm->num_states;
+    set.num_automata = fsm->num_automata;
+    set.scope = fsm->scope;
+    memcpy(set.start, fsm->start, sizeof(set.start));
+    set.next = (uintptr_t)fsm->next;
+    set.accept = (uintptr_t)fsm->accept;
+    if (ioctl(device_fd, IOCTL_SET_FSM_SET, &set) < 0) {
+        perror("Failed to upload FSM");
+        return -1;
+    }
     
-    int result = system(cmd);
-    return (result == 0);  // Returns 1 if found, 0 if not
+    printf("[FSM] Uploaded %d rules as %d automata with %d states to the kernel\n",
+           fsm->num_rules, fsm->num_automata, fsm->num_states);
+    return 0;
 }
 
+static void report_transition(const struct sm_event *ev, void *ctx) {
+    FSM* fsm = ctx;
+    
+    if (ev->outcome != OUTCOME_FSM_TRANSITION && ev->outcome != OUTCOME_FSM_ACCEPT) {
+        return;
+    }
+    
+    printf("[FSM] ✓ PID=%u observed %s(): state %u -> %u\n",
+           ev->pid, syscall_type_to_name(ev->syscall_id), ev->state_from + 1, ev->state_to + 1);
+    if (ev->outcome == OUTCOME_FSM_ACCEPT && ev->state_to < (__u32)fsm->num_states) {
+        printf("[FSM] Sequence complete: ");
+        print_rules(fsm, fsm->accept[ev->state_to]);
+        printf("\n");
+    }
+}
 
+// The kernel advances the FSM, userspace only reports transitions
 void run_fsm(FSM* fsm) {
     printf("\n[FSM] Starting FSM execution\n");
     printf("[FSM] Press Ctrl+C to stop\n\n");
     
-    system("sudo dmesg -C");
+    if (map_rings() < 0) {
+        return;
+    }
+    drain_events(NULL, NULL);
     
-    while (1) {
-        const char* current_syscall = fsm->states[fsm->current_state];
-        
-        printf("[FSM] Current State: %d/%d - Monitoring: %s\n", 
-               fsm->current_state + 1, fsm->num_states, current_syscall);
-        
-        if (set_syscall(current_syscall) < 0) {
-            printf("[ERROR] Failed to set syscall\n");
-            return;
+    if (upload_fsm(fsm) < 0 || set_mode(MODE_FSM) < 0) {
+        return;
+    }
+    
+    char expected[128];
+    
+    fsm_expected(fsm, expected, sizeof(expected));
+    printf("[FSM] Watching %d rules - Waiting for %s...\n", fsm->num_rules, expected);
+    
+    while (wait_events() == 0) {
+        drain_events(report_transition, fsm);
+        fflush(stdout);
+    }
+}
+
+// Offline FSM engine. It steps like the kernel: a syscall without a
+// transition leaves a cursor alone, and per-process cursors are only
+// created on a syscall that leaves some start state. Unlike the kernel it
+// never drops a cursor. Traces carry no exit records, and the kernel also
+// evicts cursors under memory pressure. So a reused pid continues the
+// cursor of the process that had it before. Cursors live in an
+// open-addressed table that doubles at half load, so stepping allocates
+// nothing per event.
+typedef struct {
+    const FSM *fsm;
+    uint32_t *keys;                     // pid or tgid + 1, 0 is a free slot
+    __u16 *cursors;                     // num_automata per slot
+    size_t slots;                       // power of two
+    size_t used;
+    __u32 create_mask;                  // syscalls that leave a start state
+    __u16 global_cursors[SM_FSM_MAX_AUTOMATA];
+} FsmEngine;
+
+static int fsm_engine_init(FsmEngine* e, const FSM* fsm) {
+    memset(e, 0, sizeof(*e));
+    e->fsm = fsm;
+    for (int i = 0; i < fsm->num_automata; i++) {
+        e->global_cursors[i] = fsm->start[i];
+        for (int c = 0; c < SM_NR_SYSCALLS; c++) {
+            if (fsm->next[fsm->start[i]][c] != SM_FSM_SET_NONE) e->create_mask |= 1u << c;
         }
+    }
+    e->slots = 1024;
+    e->keys = calloc(e->slots, sizeof(*e->keys));
+    e->cursors = malloc(e->slots * fsm->num_automata * sizeof(*e->cursors));
+    return e->keys && e->cursors ? 0 : -1;
+}
+
+static void fsm_engine_free(FsmEngine* e) {
+    free(e->keys);
+    free(e->cursors);
+}
+
+static inline size_t fsm_engine_hash(uint32_t key, size_t slots) {
+    return (key * 0x9e3779b1u) & (slots - 1);
+}
+
+// Cursors of key. Missing ones are inserted at the start states if create
+// is set, otherwise (or without memory) the result is NULL.
+static __u16 *fsm_engine_cursor(FsmEngine* e, uint32_t key, int create) {
+    size_t n = e->fsm->num_automata;
+    size_t i = fsm_engine_hash(key, e->slots);
+    
+    while (e->keys[i] && e->keys[i] != key) {
+        i = (i + 1) & (e->slots - 1);
+    }
+    if (e->keys[i]) return &e->cursors[i * n];
+    if (!create) return NULL;
+    
+    if ((e->used + 1) * 2 > e->slots) {
+        size_t slots = e->slots * 2;
+        uint32_t *keys = calloc(slots, sizeof(*keys));
+        __u16 *cursors = malloc(slots * n * sizeof(*cursors));
         
-        printf("[FSM] Waiting for %s() syscall...\n", current_syscall);
-        
-        int observed = 0;
-        while (!observed) {
-            sleep(1);  
-            observed = check_syscall_observed(current_syscall);
+        if (!keys || !cursors) {
+            free(keys);
+            free(cursors);
+            return NULL;
         }
+        for (size_t j = 0; j < e->slots; j++) {
+            size_t k;
+            
+            if (!e->keys[j]) continue;
+            for (k = fsm_engine_hash(e->keys[j], slots); keys[k]; k = (k + 1) & (slots - 1));
+            keys[k] = e->keys[j];
+            memcpy(&cursors[k * n], &e->cursors[j * n], n * sizeof(*cursors));
+        }
+        free(e->keys);
+        free(e->cursors);
+        e->keys = keys;
+        e->cursors = cursors;
+        e->slots = slots;
+        for (i = fsm_engine_hash(key, slots); keys[i]; i = (i + 1) & (slots - 1));
+    }
+    
+    e->keys[i] = key;
+    for (size_t j = 0; j < n; j++) {
+        e->cursors[i * n + j] = e->fsm->start[j];
+    }
+    e->used++;
+    return &e->cursors[i * n];
+}
+
+// Feed one syscall to every automaton. Returns the rules it completes and
+// sets moved to the number of transitions taken.
+static uint64_t fsm_engine_step(FsmEngine* e, const struct sm_event *ev, int *moved) {
+    const FSM *fsm = e->fsm;
+    __u16 *cursors = e->global_cursors;
+    uint64_t fired = 0;
+    
+    *moved = 0;
+    if (fsm->scope != SM_FSM_GLOBAL) {
+        cursors = fsm_engine_cursor(e, (fsm->scope == SM_FSM_PER_TGID ? ev->tgid : ev->pid) + 1,
+                                    (e->create_mask >> ev->syscall_id) & 1);
+        if (!cursors) return 0;
+    }
+    for (int i = 0; i < fsm->num_automata; i++) {
+        __u16 next = fsm->next[cursors[i]][ev->syscall_id];
         
-        printf("[FSM] ✓ Observed %s()! Transitioning to next state...\n\n", current_syscall);
-        
-        system("sudo dmesg -C");
+        if (next == SM_FSM_SET_NONE) continue;
+        cursors[i] = next;
+        fired |= fsm->accept[next];
+        (*moved)++;
+    }
+    return fired;
+}
+
+// Run a recorded trace through the FSM as fast as it decodes. A span
+// stands for weight calls of one syscall and steps that many times.
+int replay_trace(FSM* fsm, const char* path) {
+    union {
+        struct sm_event ev;
+        char bytes[SM_EVENT_MAX_SIZE];
+    } buf;
+    struct sm_event *ev = &buf.ev;
+    unsigned long long events = 0, transitions = 0, matches = 0;
+    unsigned long long rule_matches[FSM_MAX_RULES];
+    struct timespec start, stop;
+    TraceReader r;
+    FsmEngine engine;
+    double secs;
+    int ret;
+    
+    if (trace_map(&r, path) < 0) {
+        return -1;
+    }
+    if (fsm_engine_init(&engine, fsm) < 0) {
+        fsm_engine_free(&engine);
+        trace_unmap(&r);
+        return -1;
+    }
+    memset(rule_matches, 0, sizeof(rule_matches));
+    setvbuf(stdout, NULL, _IOFBF, SM_TRACE_BUF_SIZE);
+    printf("[FSM] Replaying %s\n", path);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    while ((ret = trace_next(&r, ev)) > 0) {
+        __u32 steps = (ev->flags & SM_EVENT_SPAN) ? ev->weight : 1;
         
-        fsm->current_state = (fsm->current_state + 1) % fsm->num_states;
+        events++;
+        if (ev->syscall_id >= SM_NR_SYSCALLS) continue;
         
-        sleep(1);
+        while (steps--) {
+            int moved;
+            uint64_t fired = fsm_engine_step(&engine, ev, &moved);
+            
+            if (!moved) break;          // the next call changes nothing either
+            transitions += moved;
+            if (!fired) continue;
+            for (int i = 0; i < fsm->num_rules; i++) {
+                rule_matches[i] += (fired >> i) & 1;
+            }
+            matches += __builtin_popcountll(fired);
+            printf("[FSM] ✓ %llu.%09llu PID=%u TGID=%u %s(): ",
+                   (unsigned long long)(ev->timestamp_ns / 1000000000ULL),
+                   (unsigned long long)(ev->timestamp_ns % 1000000000ULL),
+                   ev->pid, ev->tgid, syscall_type_to_name(ev->syscall_id));
+            print_rules(fsm, fired);
+            printf(" complete\n");
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    if (ret < 0) {
+        printf("[ERROR] Truncated record at offset %zu\n", (size_t)(r.p - r.base));
     }
+    printf("[FSM] Replayed %llu events: %llu transitions, %llu matches, %zu cursors "
+           "in %.3fs (%.0f events/s)\n", events, transitions, matches, engine.used,
+           secs, secs > 0 ? events / secs : 0.0);
+    if (fsm->num_rules > 1) {
+        for (int i = 0; i < fsm->num_rules; i++) {
+            printf("[FSM]   %s: %llu matches\n", fsm->rule_names[i], rule_matches[i]);
+        }
+    }
+    fflush(stdout);
+    
+    fsm_engine_free(&engine);
+    trace_unmap(&r);
+    return ret < 0 ? -1 : 0;
 }
 
 // Print usage
@@ -264,14 +3036,79 @@ void print_usage(const char* prog_name) {
     printf("Options:\n");
     printf("  --off              Set module to OFF mode\n");
     printf("  --log              Set module to LOG mode\n");
-    printf("  --block            Set module to BLOCK mode\n");
-    printf("  --syscall <name>   Set syscall to monitor (open, read, write)\n");
-    printf("  --pid <pid>        Set PID to monitor/block\n");
-    printf("  --file <json>      Run FSM from JSON file (requires --log)\n");
+    printf("  --block            Set module to BLOCK mode (targeted calls fail with EPERM)\n");
+    printf("  --latency          Set module to LATENCY mode (restarts the histograms)\n");
+    printf("  --throttle <list>  Set module to THROTTLE mode with per-thread rate limits,\n");
+    printf("                     comma separated syscall=rate[/burst] in calls per second\n");
+    printf("  --throttle-deny    Fail over-limit calls of targets with EAGAIN instead of\n");
+    printf("                     only reporting them\n");
+    printf("  --histogram        Print per-syscall latency percentiles\n");
+    printf("  --stats            Print call, block and drop counters per mode and syscall\n");
+    printf("  --syscall <list>   Set syscalls to monitor, comma separated (open, read, write,\n");
+    printf("                     close, mmap, connect, accept, execve) or all\n");
+    printf("  --pid <pid>        Set PID to monitor/block (replaces all targets)\n");
+    printf("  --add-pid <list>   Add comma separated PIDs to the target set\n");
+    printf("  --del-pid <list>   Remove PIDs from the target set\n");
+    printf("  --add-tgid <list>  Add processes (all their threads) to the target set\n");
+    printf("  --del-tgid <list>  Remove processes from the target set\n");
+    printf("  --add-cgroup <list> Add cgroup v2 ids or paths (/sys/fs/cgroup/...) to the\n");
+    printf("                     target set\n");
+    printf("  --del-cgroup <list> Remove cgroups from the target set\n");
+    printf("  --descendants      Cgroups given with --add/--del-cgroup include their subtree\n");
+    printf("  --subscribe        Watch with a private filter and rings, without touching\n");
+    printf("                     the global mode: --syscall, --capture, --sample,\n");
+    printf("                     --max-rate, --coalesce, --add-tgid and --add-cgroup (one)\n");
+    printf("                     apply to it\n");
+    printf("  --follow           Also target children forked by targets from now on\n");
+    printf("  --no-follow        Stop following and forget followed children\n");
+    printf("  --clear-targets    Monitor every process again\n");
+    printf("  --file <json>      Run FSM from JSON file in the kernel (requires --log); a\n");
+    printf("                     cycle of \"states\", explicit \"transitions\" or a syscall\n");
+    printf("                     \"pattern\" like \"open (read|write){3,} !close* connect\";\n");
+    printf("                     repeat it, or give a directory of .json files or a file\n");
+    printf("                     with a \"rules\" array, to run many rules at once\n");
+    printf("  --watch            Print events from the event rings\n");
+    printf("  --wake-events <n>  Wake readers after n events (default 1)\n");
+    printf("  --wake-usecs <us>  Wake readers at most us microseconds after an event\n");
+    printf("  --paths <list>     Only log or block opens under these comma separated path\n");
+    printf("                     prefixes, '*' and '?' match within a component, \"\" clears\n");
+    printf("  --capture <list>   Record arguments of these syscalls (fd, count, flags, path)\n");
+    printf("  --sample <n>       Emit one event in n calls of each syscall\n");
+    printf("  --max-rate <n>     Emit at most n events per second per CPU (0 for no limit)\n");
+    printf("  --coalesce <us>    Merge repeated calls of a pid on one fd into one event\n");
+    printf("                     for up to us microseconds (0 turns it off)\n");
+    printf("  --output <file>    With --watch or --subscribe, record events to a compact\n");
+    printf("                     trace file instead of printing them\n");
+    printf("  --decode <file>    Print a recorded trace and exit\n");
+    printf("  --csv              Decode as CSV\n");
+    printf("  --replay <file>    Run the --file FSM over a recorded trace offline, as fast\n");
+    printf("                     as it decodes, and report matches and events/s. Cursors\n");
+    printf("                     are never dropped, so across pid reuse or cursor\n");
+    printf("                     eviction the results can differ from the kernel's\n");
+    printf("  --daemon <dir>     Collect all rings with a pinned thread per CPU into\n");
+    printf("                     <dir>/events-NNNNNN.smt traces until Ctrl+C\n");
+    printf("  --rotate-mb <n>    Start a new daemon trace every n MiB (default %d)\n", SM_ROTATE_MB);
     printf("  --help             Display this help\n\n");
     printf("Examples:\n");
     printf("  %s --log --syscall open\n", prog_name);
+    printf("  %s --log --syscall open,read,write,close --watch\n", prog_name);
+    printf("  %s --log --syscall open --capture open --watch\n", prog_name);
+    printf("  %s --log --syscall open --paths /etc,/home/*/.ssh --watch\n", prog_name);
+    printf("  %s --log --syscall read --sample 100 --max-rate 10000 --watch\n", prog_name);
+    printf("  %s --log --syscall read,write --coalesce 10000 --watch\n", prog_name);
+    printf("  %s --log --syscall all --watch --output trace.smt\n", prog_name);
+    printf("  %s --decode trace.smt --csv > trace.csv\n", prog_name);
+    printf("  %s --log --syscall all --wake-events 4096 --daemon /var/log/syscall-monitor\n", prog_name);
     printf("  %s --log --file fsm_example1.json\n", prog_name);
+    printf("  %s --log --file fsm_example4.json\n", prog_name);
+    printf("  %s --file fsm_example2.json --replay trace.smt\n", prog_name);
+    printf("  %s --log --file fsm_example5.json --file rules/\n", prog_name);
+    printf("  %s --latency --syscall read,write --add-tgid 1234\n", prog_name);
+    printf("  %s --log --syscall execve,open --pid 1234 --follow --watch\n", prog_name);
+    printf("  %s --subscribe --syscall connect,accept --add-tgid 1234\n", prog_name);
+    printf("  %s --histogram\n", prog_name);
+    printf("  %s --throttle write=1000/5000 --throttle-deny --add-tgid 1234\n", prog_name);
+    printf("  %s --log --syscall execve --add-cgroup /sys/fs/cgroup/system.slice --descendants\n", prog_name);
     printf("  %s --off\n\n", prog_name);
 }
 
@@ -280,22 +3117,81 @@ int main(int argc, char *argv[]) {
     int mode = -1;
     char* syscall_name = NULL;
     int pid = -2;
-    char* fsm_file = NULL;
+    char* add_pids = NULL;
+    char* del_pids = NULL;
+    char* add_tgids = NULL;
+    char* del_tgids = NULL;
+    char* add_cgroups = NULL;
+    char* del_cgroups = NULL;
+    int descendants = 0;
+    int follow = -1;
+    int subscribed = 0;
+    int clear = 0;
+    char* fsm_files[FSM_MAX_RULES];
+    int num_fsm_files = 0;
+    int watch = 0;
+    int histogram = 0;
+    int stats = 0;
+    char* throttle = NULL;
+    int throttle_deny = 0;
+    int wake_events = -1;
+    int wake_usecs = -1;
+    char* capture = NULL;
+    char* paths = NULL;
+    int sample_ratio = -1;
+    int max_rate = -1;
+    int coalesce_usecs = -1;
+    char* output = NULL;
+    char* decode = NULL;
+    int csv = 0;
+    char* daemon_dir = NULL;
+    int rotate_mb = SM_ROTATE_MB;
+    char* replay = NULL;
     
     static struct option long_options[] = {
         {"off",     no_argument,       0, 'o'},
         {"log",     no_argument,       0, 'l'},
         {"block",   no_argument,       0, 'b'},
+        {"latency", no_argument,       0, 'L'},
+        {"histogram", no_argument,     0, 'H'},
+        {"stats",   no_argument,       0, 'S'},
+        {"throttle", required_argument, 0, 'T'},
+        {"throttle-deny", no_argument, 0, 'X'},
         {"syscall", required_argument, 0, 's'},
         {"pid",     required_argument, 0, 'p'},
+        {"add-pid", required_argument, 0, 'a'},
+        {"del-pid", required_argument, 0, 'd'},
+        {"add-tgid", required_argument, 0, 'A'},
+        {"del-tgid", required_argument, 0, 'D'},
+        {"add-cgroup", required_argument, 0, 'g'},
+        {"del-cgroup", required_argument, 0, 'G'},
+        {"descendants", no_argument,   0, 'Y'},
+        {"subscribe", no_argument,     0, 'u'},
+        {"follow",  no_argument,       0, 'F'},
+        {"no-follow", no_argument,     0, 'N'},
+        {"clear-targets", no_argument, 0, 'C'},
         {"file",    required_argument, 0, 'f'},
+        {"watch",   no_argument,       0, 'w'},
+        {"wake-events", required_argument, 0, 'E'},
+        {"wake-usecs",  required_argument, 0, 'U'},
+        {"capture", required_argument, 0, 'c'},
+        {"paths",   required_argument, 0, 'P'},
+        {"sample",  required_argument, 0, 'n'},
+        {"max-rate", required_argument, 0, 'R'},
+        {"coalesce", required_argument, 0, 'K'},
+        {"output",  required_argument, 0, 'O'},
+        {"decode",  required_argument, 0, 'x'},
+        {"csv",     no_argument,       0, 'V'},
+        {"daemon",  required_argument, 0, 'Z'},
+        {"rotate-mb", required_argument, 0, 'z'},
+        {"replay",  required_argument, 0, 'r'},
         {"help",    no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
     
     while (1) {
         int option_index = 0;
-        opt = getopt_long(argc, argv, "olbs:p:f:h", long_options, &option_index);
+        opt = getopt_long(argc, argv, "olbLHST:Xs:p:a:d:A:D:g:G:YuFNCf:wE:U:c:P:n:R:K:O:x:VZ:z:r:h", long_options, &option_index);
         
         if (opt == -1) break;
         
@@ -303,9 +3199,45 @@ int main(int argc, char *argv[]) {
             case 'o': mode = MODE_OFF; break;
             case 'l': mode = MODE_LOG; break;
             case 'b': mode = MODE_BLOCK; break;
+            case 'L': mode = MODE_LATENCY; break;
+            case 'H': histogram = 1; break;
+            case 'S': stats = 1; break;
+            case 'T': throttle = optarg; mode = MODE_THROTTLE; break;
+            case 'X': throttle_deny = 1; break;
             case 's': syscall_name = optarg; break;
             case 'p': pid = atoi(optarg); break;
-            case 'f': fsm_file = optarg; break;
+            case 'a': add_pids = optarg; break;
+            case 'd': del_pids = optarg; break;
+            case 'A': add_tgids = optarg; break;
+            case 'D': del_tgids = optarg; break;
+            case 'g': add_cgroups = optarg; break;
+            case 'G': del_cgroups = optarg; break;
+            case 'Y': descendants = 1; break;
+            case 'u': subscribed = 1; break;
+            case 'F': follow = 1; break;
+            case 'N': follow = 0; break;
+            case 'C': clear = 1; break;
+            case 'f':
+                if (num_fsm_files == FSM_MAX_RULES) {
+                    printf("[ERROR] --file given more than %d times\n", FSM_MAX_RULES);
+                    return 1;
+                }
+                fsm_files[num_fsm_files++] = optarg;
+                break;
+            case 'w': watch = 1; break;
+            case 'E': wake_events = atoi(optarg); break;
+            case 'U': wake_usecs = atoi(optarg); break;
+            case 'c': capture = optarg; break;
+            case 'P': paths = optarg; break;
+            case 'n': sample_ratio = atoi(optarg); break;
+            case 'R': max_rate = atoi(optarg); break;
+            case 'K': coalesce_usecs = atoi(optarg); break;
+            case 'O': output = optarg; break;
+            case 'x': decode = optarg; break;
+            case 'V': csv = 1; break;
+            case 'Z': daemon_dir = optarg; break;
+            case 'z': rotate_mb = atoi(optarg); break;
+            case 'r': replay = optarg; break;
             case 'h':
             default:
                 print_usage(argv[0]);
@@ -318,25 +3250,86 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    // Decoding is offline, no device needed
+    if (decode != NULL) {
+        return decode_trace(decode, csv) < 0 ? 1 : 0;
+    }
+    if (replay != NULL) {
+        FSM* fsm;
+        int ret;
+        
+        if (num_fsm_files == 0) {
+            printf("[ERROR] --replay needs the FSM to run given with --file\n");
+            return 1;
+        }
+        fsm = load_fsm(fsm_files, num_fsm_files);
+        if (!fsm) {
+            return 1;
+        }
+        ret = replay_trace(fsm, replay);
+        free_fsm(fsm);
+        return ret < 0 ? 1 : 0;
+    }
+    
     printf("[INFO] Opening device: %s\n", DEVICE_PATH);
     if (open_device() < 0) {
         return 1;
     }
     
-    // If FSM file provided, run FSM mode
-    if (fsm_file != NULL) {
-        if (mode != MODE_LOG) {
-            printf("[ERROR] --file can only be used with --log mode\n");
+    if (wake_events != -1 || wake_usecs != -1) {
+        if (set_wakeup(wake_events > 0 ? wake_events : 1, wake_usecs > 0 ? wake_usecs : 0) < 0) {
             close_device();
             return 1;
         }
-        
-        if (set_mode(MODE_LOG) < 0) {
+    }
+    
+    // A subscriber only reads its own rings, the rest of the options are
+    // its filter
+    if (subscribed) {
+        if (subscribe(syscall_name, capture, sample_ratio, max_rate, coalesce_usecs,
+                      add_tgids, add_cgroups) < 0) {
+            close_device();
+            return 1;
+        }
+        if (daemon_dir != NULL) {
+            int ret = run_daemon(daemon_dir, rotate_mb);
+            
+            close_device();
+            return ret < 0 ? 1 : 0;
+        }
+        watch_events(output);
+        close_device();
+        return 0;
+    }
+    
+    if (paths != NULL && set_paths(paths) < 0) {
+        close_device();
+        return 1;
+    }
+    
+    // Targets first, so a new mode never applies to the wrong processes
+    if ((clear && clear_targets() < 0) ||
+        (pid != -2 && set_pid(pid) < 0) ||
+        (add_pids && update_targets(IOCTL_ADD_PID, "PID", add_pids) < 0) ||
+        (del_pids && update_targets(IOCTL_DEL_PID, "PID", del_pids) < 0) ||
+        (add_tgids && update_targets(IOCTL_ADD_TGID, "TGID", add_tgids) < 0) ||
+        (del_tgids && update_targets(IOCTL_DEL_TGID, "TGID", del_tgids) < 0) ||
+        (add_cgroups && update_cgroups(IOCTL_ADD_CGROUP, add_cgroups, descendants) < 0) ||
+        (del_cgroups && update_cgroups(IOCTL_DEL_CGROUP, del_cgroups, descendants) < 0) ||
+        (follow != -1 && set_follow(follow) < 0)) {
+        close_device();
+        return 1;
+    }
+    
+    // If FSM files provided, run FSM mode
+    if (num_fsm_files > 0) {
+        if (mode != MODE_LOG) {
+            printf("[ERROR] --file can only be used with --log mode\n");
             close_device();
             return 1;
         }
         
-        FSM* fsm = load_fsm(fsm_file);
+        FSM* fsm = load_fsm(fsm_files, num_fsm_files);
         if (!fsm) {
             close_device();
             return 1;
@@ -349,26 +3342,44 @@ int main(int argc, char *argv[]) {
         return 0;
     }
     
+    // Buckets before the mode, so throttling starts with the right rates
+    if (throttle != NULL) {
+        if (set_throttle(throttle, throttle_deny) < 0) {
+            close_device();
+            return 1;
+        }
+    }
+    
     // Normal mode (no FSM)
-    if (mode != -1) {
-        if (set_mode(mode) < 0) {
+    if (mode != -1 || syscall_name != NULL || capture != NULL || sample_ratio != -1 ||
+        max_rate != -1 || coalesce_usecs != -1) {
+        if (set_config(mode, syscall_name, capture, sample_ratio, max_rate, coalesce_usecs) < 0) {
+            close_device();
+            return 1;
+        }
+    }
+    
+    if (histogram) {
+        if (print_latency() < 0) {
             close_device();
             return 1;
         }
     }
     
-    if (syscall_name != NULL) {
-        if (set_syscall(syscall_name) < 0) {
+    if (stats) {
+        if (print_stats() < 0) {
             close_device();
             return 1;
         }
     }
     
-    if (pid != -2) {
-        if (set_pid(pid) < 0) {
+    if (daemon_dir != NULL) {
+        if (run_daemon(daemon_dir, rotate_mb) < 0) {
             close_device();
             return 1;
         }
+    } else if (watch || output != NULL) {
+        watch_events(output);
     }
     
     close_device();